@@ -0,0 +1,183 @@
+#ifndef BINARYKNN_HPP
+#define BINARYKNN_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+
+#include "ImageProcessMethods.hpp"
+
+// Every prepared sample is thresholded to 0/255, so a single bit per pixel
+// is enough to represent it.
+constexpr int FEATURE_BITS = IMAGE_DIMENSION * IMAGE_DIMENSION;
+constexpr int FEATURE_BYTES = FEATURE_BITS / 8;
+
+// Packed rows are padded with zero bytes up to a multiple of 64 bytes. This keeps
+// every row on its own cache line(s) and lets the SIMD kernels run without a tail loop.
+// Zero padding does not change the hamming distance.
+constexpr int FEATURE_ROW_STRIDE = (FEATURE_BYTES + 63) / 64 * 64;
+
+static_assert(FEATURE_BITS % 8 == 0, "IMAGE_DIMENSION must produce a whole number of bytes.");
+
+class VPTreeIndex;
+
+namespace BinaryFeatures {
+    /**
+    * @brief Pack a single prepared feature row into bits. Any non-zero value is treated as a set bit.
+    * @param aRow A 1 x FEATURE_BITS matrix of CV_8U or CV_32F datatype.
+    * @param aOutput Destination of FEATURE_ROW_STRIDE bytes. Padding bytes are zeroed.
+    */
+    void packRow(const cv::Mat& aRow, uint8_t* aOutput);
+
+    /**
+    * @brief Pack every row of aRows, see packRow().
+    * @param aRows N x FEATURE_BITS matrix of CV_8U or CV_32F datatype.
+    * @return N x FEATURE_ROW_STRIDE matrix of CV_8U datatype.
+    */
+    cv::Mat packRows(const cv::Mat& aRows);
+
+    /**
+    * @brief Compute the hamming distance between aQuery and aCount consecutive packed rows.
+    * The kernel (AVX-512, AVX2 or scalar) is selected once at runtime depending on the host CPU.
+    * @param aQuery Packed query row of FEATURE_ROW_STRIDE bytes.
+    * @param aRows First of aCount packed rows, each FEATURE_ROW_STRIDE bytes apart and 64 byte aligned.
+    * @param aCount Number of rows to compare against.
+    * @param aDistances Output array of aCount distances.
+    */
+    void hammingDistances(const uint8_t* aQuery, const uint8_t* aRows, size_t aCount, uint32_t* aDistances);
+
+    /**
+    * @brief Name of the distance kernel selected for this CPU. Useful for logging.
+    */
+    const char* kernelName();
+}
+
+/**
+ * A kNN classifier working on bit packed features. Reference samples are stored
+ * as FEATURE_BITS bit rows (FEATURE_BYTES bytes instead of FEATURE_BITS floats) and compared
+ * using the hamming distance. For samples thresholded to 0/255 the hamming distance is
+ * the squared L2 distance divided by 255^2, so predictions match cv::ml::KNearest.
+ *
+ * The findNearest() method mirrors cv::ml::KNearest::findNearest() so both models
+ * can be used interchangeably. Distances are reported in bits.
+ *
+ * Samples can be added with addSample() while the model is searched, e.g. drawings
+ * corrected by the user. They are kept apart from the reference set and searched
+ * by brute force after it.
+ */
+class BinaryKNearest {
+public:
+    // Samples addSample() accepts.
+    static constexpr int MAX_ADDED_SAMPLES = 65536;
+
+    BinaryKNearest();
+    ~BinaryKNearest();
+
+    /**
+    * @brief Create an empty model.
+    */
+    static cv::Ptr<BinaryKNearest> create();
+
+    /**
+    * @brief Load the samples and responses stored in an OpenCV kNN model (.opknn) and pack them.
+    * @param aFilepath Path to the serialized cv::ml::KNearest model.
+    * @return Loaded model. Empty model if the file could not be read.
+    */
+    static cv::Ptr<BinaryKNearest> load(const std::string& aFilepath);
+
+    /**
+    * @brief Replace the reference set.
+    * @param aSamples N x FEATURE_BITS matrix of CV_8U or CV_32F datatype.
+    * @param aResponses N labels of CV_32F or CV_32S datatype.
+    * @return false if the dimensions do not match.
+    */
+    bool train(const cv::Mat& aSamples, const cv::Mat& aResponses);
+
+    /**
+    * @brief Replace the reference set with already packed samples. The matrices are used in place,
+    * no data is copied. This is how memory mapped models (see ModelFile.hpp) are attached.
+    * @param aPackedSamples N x FEATURE_ROW_STRIDE matrix of CV_8U datatype.
+    * @param aResponses N labels of CV_32S datatype.
+    * @param aStorage Optional owner of the memory behind both matrices, kept alive as long as the model.
+    * @return false if the dimensions or datatypes do not match.
+    */
+    bool setPackedSamples(const cv::Mat& aPackedSamples, const cv::Mat& aResponses,
+                          std::shared_ptr<const void> aStorage = nullptr);
+
+    /**
+    * @brief Add a sample without copying the reference set. Thread safe, searches running
+    * meanwhile may or may not see it, later searches do. Replacing the reference set drops
+    * the added samples.
+    * @param aPackedRow Packed feature row of FEATURE_ROW_STRIDE bytes, see BinaryFeatures::packRow().
+    * @param aLabel Label of the sample.
+    * @return false once MAX_ADDED_SAMPLES samples were added.
+    */
+    bool addSample(const uint8_t* aPackedRow, int aLabel);
+
+    /**
+    * @brief Number of samples added with addSample(), not part of getSampleCount().
+    */
+    int getAddedSampleCount() const;
+
+    /**
+    * @brief Find the aK nearest neighbours of every row in aSamples and vote on a label.
+    * Ties between labels are resolved toward the smaller label, like cv::ml::KNearest.
+    * @param aSamples N x FEATURE_BITS matrix of CV_8U or CV_32F datatype.
+    * @param aK Number of neighbours to consult.
+    * @param aResults N x 1 CV_32F predicted labels.
+    * @param aNeighborResponses N x aK CV_32F labels of the neighbours.
+    * @param aDistances N x aK CV_32F hamming distances to the neighbours.
+    * @return The predicted label of the first sample.
+    */
+    float findNearest(cv::InputArray aSamples, int aK, cv::OutputArray aResults,
+                      cv::OutputArray aNeighborResponses = cv::noArray(),
+                      cv::OutputArray aDistances = cv::noArray()) const;
+
+    bool empty() const;
+
+    /**
+    * @brief Number of samples in the reference set.
+    */
+    int getSampleCount() const;
+
+    /**
+    * @brief Search through aIndex instead of scanning every sample.
+    * The index is ignored if it was not built for the samples of this model.
+    * @param aIndex Index built over getPackedSamples(). Pass an empty pointer to go back to brute force.
+    */
+    void setIndex(const cv::Ptr<VPTreeIndex>& aIndex);
+
+    cv::Ptr<VPTreeIndex> getIndex() const;
+
+    /**
+    * @brief N x FEATURE_ROW_STRIDE packed reference samples.
+    */
+    const cv::Mat& getPackedSamples() const;
+
+    /**
+    * @brief 1 x N labels of the reference samples, CV_32S.
+    */
+    const cv::Mat& getResponses() const;
+
+private:
+    struct AddedSamples;
+
+    // N x FEATURE_ROW_STRIDE packed reference samples.
+    cv::Mat mSamples;
+
+    // 1 x N label of each reference sample, CV_32S.
+    cv::Mat mResponses;
+
+    // Owner of the memory mSamples and mResponses point into, when they do not own it themselves.
+    std::shared_ptr<const void> mStorage;
+
+    // Optional nearest neighbour index over mSamples.
+    cv::Ptr<VPTreeIndex> mIndex;
+
+    // Samples given to addSample().
+    std::unique_ptr<AddedSamples> mAdded;
+};
+
+#endif // !BINARYKNN_HPP
@@ -1,15 +1,23 @@
 #ifndef DRAWAREA_H
 #define DRAWAREA_H
 
+#include <memory>
 #include <vector>
 #include "opencv2/ml.hpp"
 
+#include <QFutureWatcher>
+#include <QImage>
 #include <QLabel>
 #include <QMap>
 #include <QPointer>
+#include <QRect>
+#include <QTimer>
 
+#include "BinaryKNN.hpp"
 #include "DrawLayer.hpp"
 #include "Log.hpp"
+#include "RecognitionExecutor.hpp"
+#include "SampleLog.hpp"
 
 class DrawArea : public QLabel {
     Q_OBJECT
@@ -21,6 +29,17 @@ public:
     void mouseReleaseEvent(QMouseEvent* event) override;
     void mouseMoveEvent(QMouseEvent* event) override;
 
+    /**
+    * @brief Copy the invalidated part of the canvas to the screen.
+    */
+    void paintEvent(QPaintEvent* event) override;
+
+    /**
+    * @brief The draw area always has the size of its canvas.
+    */
+    QSize sizeHint() const override;
+    QSize minimumSizeHint() const override;
+
     void resizeDrawArea(QSize aSize);
 
     void updateDrawArea();
@@ -28,10 +47,13 @@ public:
     /**
     * @brief generateImage
     * Creates a QImage based on the current
-    * Hardlayer.
+    * canvas.
     * Note, we don't use virtual layer since
     * a virtual layer only contains the currently
     * active pixels.
+    * The image shares the canvas raster, no pixel
+    * is copied unless the canvas is drawn on while
+    * the image is still in use.
     */
     QImage generateImage();
 
@@ -47,8 +69,10 @@ public:
     * and scales the set of comparison images to match.
     * The important part is that we will compute the comparison
     * value between the hardlayer image and the comparison sets.
+    * The comparison runs on a worker thread, its result is delivered
+    * through layerCompared(). A new call supersedes the previous one.
     */
-    int compareLayer();
+    void compareLayer();
 
     /**
     * @brief Grab the comparison image at index. To be used
@@ -57,13 +81,57 @@ public:
     */
     QImage getResourceCharacterImage(int aLabel);
 
+    /**
+    * @brief Whether the kNN model has finished loading. The model and
+    * resource images are loaded on a worker thread, see modelReady().
+    */
+    bool isModelReady() const;
+
+    /**
+    * @brief Rectangle covering every enabled stroke, tracked while drawing
+    * so the ROI never needs a scan of the whole canvas.
+    * Null if nothing is drawn.
+    */
+    QRect getInkBounds() const;
+
+    /**
+    * @brief Results of earlier recognitions, with their hit and miss counters.
+    */
+    const RecognitionCache& getRecognitionCache() const;
+
     /**
     * @brief Remove from mVirtualLayerVector the layer
     * at the head. Note, this does not disable
     * the layer, but instead removes it.
+    * The removed layer can be restored with redoLayer().
     */
     void undoLayer();
 
+    /**
+    * @brief Restore the layer removed by the last undoLayer().
+    * Drawing a new stroke discards the layers that can be restored.
+    */
+    void redoLayer();
+
+public slots:
+    /**
+    * @brief Recognize the drawing every time a stroke is finished, without
+    * waiting for compareLayer() to be called.
+    * @param aEnabled true to enable live recognition.
+    */
+    void setLiveRecognition(bool aEnabled);
+
+    /**
+    * @brief Add the drawing to the model as a sample of aLabel, e.g. after a wrong
+    * prediction. It is taken into account by the next recognition, which is started
+    * right away, and written to the sample log so it is merged into the model file
+    * on the next startup. Only the bit packed model accepts samples.
+    * @param aLabel numeric value representing a label for a character.
+    * @param aFingerprint RecognitionResult::fingerprint of the result being corrected. Nothing
+    * is learned if the drawing changed since, the correction was meant for another drawing.
+    */
+    void learnDrawing(int aLabel, quint64 aFingerprint);
+
 signals:
     /**
      * @brief Notifies any parent or object that layers have
@@ -71,29 +139,118 @@ signals:
      */
     void layerUpdateHandle();
 
+    /**
+     * @brief Emitted once the background loading of the model and
+     * resource images has finished.
+     * @param aLoaded true if a kNN model could be loaded.
+     */
+    void modelReady(bool aLoaded);
+
+    /**
+     * @brief Delivers the result of the latest compareLayer() call.
+     * @param aLabel numeric value representing a label for a character.
+     */
+    void layerCompared(int aLabel);
+
+    /**
+     * @brief Same as layerCompared(), with the confidence and the alternative candidates.
+     */
+    void layerRecognized(const RecognitionResult& aResult);
+
+    /**
+     * @brief Emitted when a stroke is started, undone or redone, before the
+     * drawing is recognized again. The last result no longer describes it.
+     */
+    void drawingChanged();
+
+private slots:
+    /**
+     * @brief Take ownership of the resources loaded on the worker thread.
+     */
+    void pResourcesLoaded();
+
+    /**
+     * @brief Forward a result of the executor through layerCompared() and layerRecognized().
+     */
+    void pRecognized(const RecognitionResult& aResult);
+
 private:
+    // Everything loaded from the resource folder on the worker thread.
+    struct Resources {
+        cv::Ptr<cv::ml::KNearest> knn;
+        cv::Ptr<BinaryKNearest> binaryKnn;
+        QMap<int, QImage> comparisonImages;
+        std::shared_ptr<SampleLog> sampleLog;
+    };
+
+    // Composite of the first (index + 1) * CHECKPOINT_INTERVAL strokes.
+    struct Checkpoint {
+        QImage composite;
+        QRect inkBounds;
+    };
+
+    /**
+     * @brief Rasterize a finished stroke on the canvas and add it to the ink bounds.
+     */
+    void pPaintLayer(const DrawLayer& aLayer);
+
     /**
-     * @brief Draws a point between the previous point drawn and
-     * the new point created by the users mouse press.
+     * @brief Keep a copy of the canvas if the stroke count reached the next checkpoint.
+     */
+    void pCheckpoint();
+
+    /**
+     * @brief Rebuild the canvas for the current strokes from the last checkpoint
+     * covering them, only the strokes drawn since are rasterized again.
+     */
+    void pRestoreComposite();
+
+    /**
+     * @brief Extends the stroke being drawn from the previous point
+     * to the new point created by the users mouse press. The segment is
+     * only queued, it is rasterized by the next frame, see pFlushStroke().
      * @param aPoint A new point to draw a line to from previous point.
+     * @param aTimestamp Time the point was sampled at, in milliseconds.
+     */
+    void pDrawPoint(QPoint aPoint, qint64 aTimestamp);
+
+    /**
+     * @brief Rasterize the points queued since the last frame as
+     * a single polyline, in one painter pass.
      */
-    void pDrawPoint(QPoint aPoint);
+    void pFlushStroke();
+
+    /**
+     * @brief Fingerprint of the drawing: the canvas size and the points and width
+     * of every enabled stroke, in order. Equal drawings get equal fingerprints,
+     * e.g. after undoing and redoing a stroke.
+     */
+    quint64 pFingerprint() const;
+
+    /**
+    * @brief Load the kNN model and the character images. Runs on a worker
+    * thread, so it must not touch any member.
+    * @param aKnnDictFilepath text file path to load in numerical keys to images.
+    */
+    static Resources pLoadResources(const std::string& aKnnDictFilepath);
 
     /**
     * @brief Load from memory a series of characters
     * to compare with the users drawings.
+    * @param aKnnDictFilepath text file path to load in numerical keys to images.
     */
-    void pResourceCharacterImages();
+    static QMap<int, QImage> pResourceCharacterImages(const std::string& aKnnDictFilepath);
 
 private:
     // Set to true on mouse down. Set to false on mouse up
     bool mCurrentlyDrawing;
 
-    // Hard layer is what is shown to the user. Contains
-    // draw virtual layers that are enabled.
-    DrawLayer mHardLayer;
+    // Canvas is what is shown to the user. Contains
+    // draw virtual layers that are enabled. Also read
+    // by recognition without any conversion.
+    QImage mCanvasImage;
 
-    // Virtual layer is the individual layers that are drawn.
+    // Virtual layer is the stroke being drawn.
     DrawLayer mVirtualLayer;
 
     // Used to calculate a line of best fit as the mouse positions
@@ -101,11 +258,22 @@ private:
     // Primarily used in the pDrawPoint() method.
     QPoint mPrevPoint;
 
-    // Vector of layers that the User has drawn. We only
+    // Points of mVirtualLayer already rasterized into the canvas.
+    // The others are drawn by the next frame.
+    int mFlushedPoints;
+
+    // Vector of strokes that the User has drawn. We only
     // store virtual layers in this vector. They are used
-    // to draw the hard layer.
+    // to draw the canvas.
     QVector<DrawLayer> mVirtualLayerVector;
 
+    // Layers removed by undoLayer(), the last one is restored first.
+    QVector<DrawLayer> mRedoLayerVector;
+
+    // Composites of the canvas every CHECKPOINT_INTERVAL strokes, so undoing
+    // never needs to rasterize more than CHECKPOINT_INTERVAL strokes.
+    QVector<Checkpoint> mCheckpoints;
+
     // Incremented when _add_new_layer is called.
     uint mId;
 
@@ -117,13 +285,40 @@ private:
     // QVector<QImage> mComparisonImages;
     QMap<int, QImage> mComparisonImagesDict;
 
-    // kNN model used to predict what the user has drawn
+    // kNN model used to predict what the user has drawn.
+    // Only loaded when the bit packed model below is not available.
     cv::Ptr<cv::ml::KNearest> mKnn;
 
+    // Bit packed kNN model used to predict what the user has drawn.
+    // Gives the same predictions as mKnn using a fraction of the memory.
+    cv::Ptr<BinaryKNearest> mBinaryKnn;
+
+    // Samples added with learnDrawing() are appended to it. Only open with the bit packed model.
+    std::shared_ptr<SampleLog> mSampleLog;
+
     // text file path to load in numerical keys to images
     // based on the knn model.
     std::string mKnnDictFilepath;
 
+    // Runs compareLayer() requests off the GUI thread.
+    RecognitionExecutor* mRecognitionExecutor;
+
+    // Watches the worker thread loading the resources.
+    QFutureWatcher<Resources>* mLoadWatcher;
+
+    // Set once the resources are loaded and a model is available.
+    bool mModelReady;
+
+    // Union of the ink bounds of the enabled layers in mVirtualLayerVector
+    // and of the stroke being drawn.
+    QRect mInkBounds;
+
+    // Whether compareLayer() runs after every stroke.
+    bool mLiveRecognition;
+
+    // Delays live recognition until the user pauses between strokes.
+    QTimer* mLiveTimer;
+
 };
 
 #endif // DRAWAREA_H
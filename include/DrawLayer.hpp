@@ -1,14 +1,22 @@
 #ifndef DRAWLAYER_H
 #define DRAWLAYER_H
 
-#include <QPixmap>
+#include <QPen>
+#include <QPoint>
+#include <QRect>
+#include <QVector>
 
-class DrawLayer : public QPixmap {
+class QPainter;
 
-//    Q_OBJECT
+/**
+ * A single stroke drawn by the user. Only the points and the pen are
+ * stored, the stroke is rasterized on demand with paint(). Its memory
+ * does not depend on the resolution of the canvas.
+ */
+class DrawLayer {
 
 public:
-    DrawLayer(QSize aSize, uint id);
+    DrawLayer(uint aId = 0, uint aWidth = 1);
     ~DrawLayer() = default;
 
     /**
@@ -29,6 +37,42 @@ public:
 
     void setEnableStatus(bool status);
 
+    /**
+     * @brief Width of the pen the stroke is drawn with.
+     */
+    uint getWidth() const;
+
+    /**
+     * @brief Pen the stroke is drawn with.
+     */
+    QPen getPen() const;
+
+    /**
+     * @brief Extend the stroke to aPoint.
+     * @param aTimestamp Time the point was sampled at, in milliseconds.
+     */
+    void addPoint(const QPoint& aPoint, qint64 aTimestamp = 0);
+
+    const QVector<QPoint>& getPoints() const;
+
+    /**
+     * @brief Sampling time of every point, in milliseconds.
+     */
+    const QVector<qint64>& getTimestamps() const;
+
+    /**
+     * @brief Rectangle covering every pixel drawn by the stroke.
+     * Null if the stroke has no point.
+     */
+    QRect getInkBounds() const;
+
+    /**
+     * @brief Rasterize the stroke as a single polyline.
+     * @param aPainter Painter active on the surface to draw on.
+     * @param aFirstPoint Only rasterize the stroke from this point on, joined to the point before it.
+     */
+    void paint(QPainter& aPainter, int aFirstPoint = 0) const;
+
 private:
     // Numerical id for the layer.
     uint mId;
@@ -36,6 +80,18 @@ private:
     // Is the layer currently being shown?
     bool mEnabled;
 
+    // Pen width.
+    uint mWidth;
+
+    // Points of the stroke, in drawing order.
+    QVector<QPoint> mPoints;
+
+    // Sampling time of every point in mPoints.
+    QVector<qint64> mTimestamps;
+
+    // Area covering everything drawn by the stroke.
+    QRect mInkBounds;
+
 };
 
 
@@ -8,9 +8,25 @@
 // This avoids errors if the kNN model parameters change.
 constexpr int IMAGE_DIMENSION = 48;
 
+// Number of neighbours the kNN model consults for every query.
+constexpr int KNN_NEIGHBOURS = 4;
+
 class QImage;
+class BinaryKNearest;
 
 namespace ImageMethods {
+    /**
+    * @brief Buffers reused by rescaleROIToFeatures(). The feature rows are only ever grown,
+    * so once sized for the most scalars, calls with as many or fewer do not allocate.
+    */
+    struct FeatureWorkspace {
+        // One prepared feature row per scale, CV_32F.
+        cv::Mat features;
+
+        // IMAGE_DIMENSION x IMAGE_DIMENSION resample of the ROI, CV_8U.
+        cv::Mat sample;
+    };
+
     /**
     * @brief Converts a QImage to a compatible OpenCV matrix. Ideally, used when converting a the hardlayer
     * to OpenCV matrix to begin processing with available libraries.
@@ -22,6 +38,23 @@ namespace ImageMethods {
     */
     cv::Mat qImageToCvMat(QImage aImage);
 
+    /**
+    * @brief Converts a QImage to an inverted grayscale OpenCV matrix (white character on black
+    * background), the form every technique expects, in a single pass over the pixels.
+    * Gives the same values as qImageToCvMat() followed by cv::bitwise_not().
+    * @param aImage A 32 bit Qt Image. Other formats are converted first.
+    * @param aOutput Destination matrix of CV_8U datatype. Reused if it already has the size of aImage.
+    */
+    void qImageToInvertedGray(const QImage& aImage, cv::Mat& aOutput);
+
+    /**
+    * @brief Binarize a grayscale image of a character with Otsu's threshold into a white
+    * character on black, the form every technique expects. Whatever covers most of the
+    * border is taken as the background, so dark on light scans are inverted.
+    * @param aImage Grayscale image of CV_8U datatype, at least 3 x 3. Modified in place.
+    */
+    void binarizeCharacter(cv::Mat& aImage);
+
     /**
      * @brief Pass a processed image through the kNN model.
      * @param aKNNModel Pointer to currently loaded model.
@@ -38,6 +71,45 @@ namespace ImageMethods {
     */
     int passThroughKNNModel(const cv::Ptr<cv::ml::KNearest>& aKNNModel, const std::vector<cv::Mat>& aProcessedImages);
 
+    /**
+    * @brief Pass a set of processed images through the kNN model using a single search.
+    * Every image is prepared and stacked into one N x (IMAGE_DIMENSION * IMAGE_DIMENSION) query matrix
+    * so the reference set is only scanned once, no matter how many images are passed.
+    * @param aKNNModel Pointer to currently loaded model.
+    * @param aProcessedImages A set of processed images give by one of the builtin techniques.
+    * @param aDistances Optional output. N x KNN_NEIGHBOURS matrix (CV_32F) holding the distance of
+    * each image to its nearest neighbours.
+    * @return label calculated by the kNN model for every image, in the same order as aProcessedImages.
+    * Empty if the model could not process the query.
+    */
+    std::vector<int> passThroughKNNModelBatch(const cv::Ptr<cv::ml::KNearest>& aKNNModel,
+                                              const std::vector<cv::Mat>& aProcessedImages,
+                                              cv::Mat* aDistances = nullptr);
+
+    /**
+     * @brief Pass a processed image through the bit packed kNN model.
+     * @param aKNNModel Pointer to currently loaded model.
+     * @param aProcessedImage An image processed through one of the builtin techniques.
+     * @return int label calculated by the kNN model.
+     */
+    int passThroughKNNModel(const cv::Ptr<BinaryKNearest>& aKNNModel, const cv::Mat& aProcessedImage);
+
+    /**
+    * @brief Pass a set of processed images through the bit packed kNN model.
+    * @param Pointer to currently loaded model.
+    * @param aProcessedImages A set of processed images give by one of the builtin techniques.
+    * @return int label calculated by the kNN model.
+    */
+    int passThroughKNNModel(const cv::Ptr<BinaryKNearest>& aKNNModel, const std::vector<cv::Mat>& aProcessedImages);
+
+    /**
+    * @brief Same as the cv::ml::KNearest overload, using the bit packed kNN model.
+    * Distances are given in bits.
+    */
+    std::vector<int> passThroughKNNModelBatch(const cv::Ptr<BinaryKNearest>& aKNNModel,
+                                              const std::vector<cv::Mat>& aProcessedImages,
+                                              cv::Mat* aDistances = nullptr);
+
     /**
     * @brief Resizes the passed matrix to correct and datatype to passed through the loaded kNN model.
     * The dimension the matrix will be converted to is IMAGE_DIMENSION x IMAGE_DIMENSION. In addition,
@@ -47,6 +119,14 @@ namespace ImageMethods {
     */
     cv::Mat prepareMatrixForKNN(cv::Mat aMat);
 
+    /**
+    * @brief Prepare every matrix with prepareMatrixForKNN() and stack the results into
+    * a single matrix, one row per image.
+    * @param aMats A set of OpenCV matrices to convert.
+    * @return matrix of dimension aMats.size() x (IMAGE_DIMENSION * IMAGE_DIMENSION) and CV_32F datatype.
+    */
+    cv::Mat prepareBatchForKNN(const std::vector<cv::Mat>& aMats);
+
     /**
     * @brief Given a drawn image, find the region
     * of interest that contains the character.
@@ -54,10 +134,20 @@ namespace ImageMethods {
     * finding the correct ROI will not be possible.
     * @param aMat An OpenCV matrix that must be greyscaled and thresholded.
     * @return OpenCV rect containing the dimensions for the character drawn
-    * by the user.
+    * by the user. The width and height are negative if nothing was drawn.
     */
     cv::Rect obtainROI(cv::Mat aMat);
 
+    /**
+    * @brief Same as obtainROI(aMat), only looking for the character inside aSearchArea.
+    * The cost depends on the size of aSearchArea instead of the whole image.
+    * @param aMat An OpenCV matrix that must be greyscaled and thresholded.
+    * @param aSearchArea Area known to hold every pixel of the character, e.g. the ink
+    * bounds tracked while drawing. Clipped to the image.
+    * @return OpenCV rect in aMat coordinates, see obtainROI(aMat).
+    */
+    cv::Rect obtainROI(const cv::Mat& aMat, const cv::Rect& aSearchArea);
+
     /**
      * @brief given an ROI image, create a blank image of aHeight x aWidth and
      * center the ROI image into that blank image.
@@ -81,6 +171,21 @@ namespace ImageMethods {
     std::vector<cv::Mat> rescaleROI(const std::vector<float>& aTargetScalars,
                                            const cv::Mat& aROI, int aHeight, int aWidth, bool debugFlag);
 
+    /**
+     * @brief Fused equivalent of rescaleROI() followed by prepareBatchForKNN(). Every scale is mapped
+     * from the ROI straight to the IMAGE_DIMENSION x IMAGE_DIMENSION feature with a single affine
+     * resample, without building the rescaled images at full resolution.
+     * The features match the unfused pipeline up to a few pixels along the edges of the strokes.
+     * @param aTargetScalars Set of scalar values to rescale ROI with.
+     * @param aBaseImage Drawn character by the user, grayscaled with a white character on black.
+     * @param aROI Region of interest, as returned by obtainROI().
+     * @param aWorkspace Buffers written to. Reused between calls.
+     * @return One feature row per scale that fits the base image, CV_32F. Points into aWorkspace,
+     * so it is only valid until the next call using the same workspace.
+     */
+    cv::Mat rescaleROIToFeatures(const std::vector<float>& aTargetScalars, const cv::Mat& aBaseImage,
+                                 const cv::Rect& aROI, FeatureWorkspace& aWorkspace);
+
     /**
      * @brief Given a set of calculated labels, find the most frequently occuring label.
      * @param aLabels vector of calculated labels.
@@ -99,6 +204,16 @@ namespace TechniqueMethods {
      */
     cv::Mat ROITranslocation(const cv::Mat& aBaseImage, bool debugFlag);
 
+    /**
+     * @brief Same as ROITranslocation(aBaseImage, debugFlag), using an already known ROI
+     * instead of scanning the base image for it.
+     * @param aBaseImage Drawn character by the user. Needs to be an OpenCV matrix.
+     * @param aROI Region of interest, as returned by ImageMethods::obtainROI().
+     * @param debugFlag Boolean flag to write sample images and print statements.
+     * @return Return an image which has a centered ROI.
+     */
+    cv::Mat ROITranslocation(const cv::Mat& aBaseImage, const cv::Rect& aROI, bool debugFlag);
+
     // Method Description:
     // Takes a given base image, find ROI, and centers it into image of original dimensions.
     // After centering, the ROI is then scaled to various scalar values.
@@ -113,6 +228,35 @@ namespace TechniqueMethods {
      * @return Return a vector of ROI rescaled images.
      */
     std::vector<cv::Mat> ROIRescaling(const cv::Mat& aBaseImage, bool debugFlag);
+
+    /**
+     * @brief Same as ROIRescaling(aBaseImage, debugFlag), using an already known ROI
+     * instead of scanning the base image for it.
+     * @param aBaseImage Drawn character by the user. Needs to be an OpenCV matrix.
+     * @param aROI Region of interest, as returned by ImageMethods::obtainROI().
+     * @param debugFlag Boolean flag to write sample images and print statements.
+     * @return Return a vector of ROI rescaled images.
+     */
+    std::vector<cv::Mat> ROIRescaling(const cv::Mat& aBaseImage, const cv::Rect& aROI, bool debugFlag);
+
+    /**
+     * @brief Same as passing the images of ROIRescaling(aBaseImage, aROI, false) through
+     * ImageMethods::prepareBatchForKNN(), using ImageMethods::rescaleROIToFeatures().
+     * @param aBaseImage Drawn character by the user. Needs to be an OpenCV matrix.
+     * @param aROI Region of interest, as returned by ImageMethods::obtainROI().
+     * @param aWorkspace Buffers reused between calls.
+     * @return One feature row per scale, valid until the next call using aWorkspace.
+     */
+    cv::Mat ROIRescalingFeatures(const cv::Mat& aBaseImage, const cv::Rect& aROI,
+                                 ImageMethods::FeatureWorkspace& aWorkspace);
+
+    /**
+     * @brief Scales of ROIRescaling() ordered by their distance to 1.0, nearest first
+     * (1.0, .95, 1.05, .90, ...). Scales close to the drawn size are the most reliable,
+     * evaluating them first lets a caller stop once the result is clear.
+     * @return Scales to pass to ImageMethods::rescaleROIToFeatures(), in order.
+     */
+    const std::vector<float>& ROIRescalingScalarsByDistance();
 }
 
 #endif // !IMAGEPROCESSMETHODS_HPP
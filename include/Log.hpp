@@ -1,10 +1,15 @@
 #ifndef LOG_HPP
 #define LOG_HPP
 
-#include <QDebug>
-#include <QDateTime>
 #include <QString>
-#include <QFile>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 
 /**
 * This is a very basic logging system.
@@ -12,6 +17,14 @@
 * and writing to file.
 *
 * The class is structured as a singleton object.
+*
+* Logging never blocks the caller: records are pushed into a fixed size ring
+* buffer and written by a background thread, in batches. When the buffer is
+* full the record is dropped and counted instead. Safe to call from any thread.
+*
+* Use the LOG() macro. The level is checked before the location and the
+* message are evaluated, a disabled statement only costs a load and a branch.
+* Levels missing from LOG_COMPILED_LEVELS are removed from the binary.
 */
 
 // https://stackoverflow.com/questions/1008019/c-singleton-design-pattern
@@ -31,54 +44,110 @@ public:
         return instance;
     }
 
-//    static void setLevel(int aLevel) {
-//        mLevel = aLevel;
-//    }
-
-    static void logData(const int aLevel, const QString& aMethodLocation, const QString& aInfo) {
-        QString output = "[ " + getTime() + " ] " + aMethodLocation + ": " + aInfo;
-        if (mLevel & aLevel) {
-            qInfo() << output;
-            if(mFile.isOpen()) {
-                QTextStream logFile(&mFile);
-                logFile << output << "\n";
-            }
-        }
+    static void setLevel(int aLevel) {
+        mLevel.store(aLevel, std::memory_order_relaxed);
+    }
+
+    static bool isEnabled(int aLevel) {
+        return mLevel.load(std::memory_order_relaxed) & aLevel;
     }
 
+    static void logData(const int aLevel, const QString& aMethodLocation, const QString& aInfo);
+
+    /**
+    * @brief Same as logData(), literals are copied into the record without any allocation.
+    */
+    static void logData(const int aLevel, const char* aMethodLocation, const char* aInfo);
+
+    /**
+    * @brief Number of records dropped because the ring buffer was full.
+    */
+    static uint64_t getDroppedCount();
+
     Logger(Logger const&) = delete;
     void operator=(Logger const&) = delete;
 
 private:
-    Logger() {
-        open();
-        mLevel = level::standard | level::warning | level::error;
-    }
+    // Records waiting to be written. A power of two.
+    static constexpr size_t RING_CAPACITY = 1024;
 
-    ~Logger() {
-        close();
-    }
+    // Longer messages are truncated.
+    static constexpr size_t RECORD_SIZE = 240;
 
-    static void close() {
-        mFile.close();
-    }
+    struct Record {
+        // Position the slot is ready for, see pPush() and pPop().
+        std::atomic<size_t> sequence;
+        qint64 time;
+        uint32_t length;
+        char text[RECORD_SIZE];
+    };
 
-    static void open() {
-        mFile.open(QIODevice::ReadWrite | QIODevice::Text | QIODevice::Truncate);
-    }
+    Logger();
 
-    static QString getTime() {
-        return std::move(QDateTime::currentDateTime().toString("hh:mm:ss"));
-    }
+    /**
+    * @brief Write every record still queued, then stop the writer.
+    */
+    ~Logger();
+
+    /**
+    * @brief Queue a record. Lock free, fails if the buffer is full.
+    */
+    bool pPush(const char* aMethodLocation, size_t aLocationLength, const char* aInfo, size_t aInfoLength);
+
+    /**
+    * @brief Take the oldest record and append it to aBatch. Writer thread only.
+    * @return false if the buffer is empty.
+    */
+    bool pPop(std::string& aBatch);
+
+    bool pHasRecord() const;
+
+    /**
+    * @brief Background writer, drains the buffer into the console and the log file.
+    */
+    void pRun();
 
 private:
     static inline const char* mOutputFileName = "../Log.txt";
-    static inline QFile mFile = QFile(mOutputFileName);
-    static inline int mLevel;
-};
+    static inline std::atomic<int> mLevel{level::standard | level::warning | level::error};
 
-static const auto LOG = Logger::getInstance().logData;
+    // Set once the singleton is destroyed, later records are ignored.
+    static inline std::atomic<bool> mShutDown{false};
 
-#endif // !LOG_HPP
+    std::unique_ptr<Record[]> mRecords;
+
+    // Next position to write to, shared by the producers.
+    alignas(64) std::atomic<size_t> mEnqueuePosition;
+
+    // Next position to read from, only used by the writer.
+    alignas(64) size_t mDequeuePosition;
+
+    std::atomic<uint64_t> mDropped;
+
+    std::atomic<bool> mStopping;
+
+    std::mutex mWakeMutex;
 
+    std::condition_variable mWake;
 
+    std::thread mWriter;
+};
+
+// Bit mask of the levels compiled in, see the LOG_COMPILED_LEVELS CMake variable.
+#ifndef LOG_COMPILED_LEVELS
+#define LOG_COMPILED_LEVELS (level::standard | level::warning | level::error | level::info)
+#endif
+
+/**
+* Log aInfo at aLevel. aMethodLocation and aInfo are only evaluated if aLevel
+* is enabled, so building the message costs nothing when it is filtered out.
+*/
+#define LOG(aLevel, aMethodLocation, aInfo) \
+    do { \
+        if constexpr (((aLevel) & (LOG_COMPILED_LEVELS)) != 0) { \
+            if (Logger::isEnabled(aLevel)) \
+                Logger::logData((aLevel), (aMethodLocation), (aInfo)); \
+        } \
+    } while (false)
+
+#endif // !LOG_HPP
@@ -0,0 +1,118 @@
+#ifndef MODELFILE_HPP
+#define MODELFILE_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+
+#include "BinaryKNN.hpp"
+
+/**
+* Compact binary kNN model (.jpknn) that is memory mapped and used in place.
+* Loading a model only maps the file, pages are brought in by the first queries
+* touching them. Every process mapping the same file shares one physical copy.
+*
+* Layout, all values in host (little endian) byte order:
+*   ModelFileHeader                        64 bytes
+*   samples    sampleCount x rowStride     starts 64 byte aligned, every row 64 byte aligned
+*   responses  sampleCount x int32         label of every sample
+*   labels     labelCount x int32          sorted table of the distinct labels
+*/
+
+// How the samples of a model file are encoded.
+enum class FeatureEncoding : uint32_t {
+    // One bit per pixel, see BinaryFeatures::packRow().
+    PackedBits = 1
+};
+
+struct ModelFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t imageDimension;
+    uint32_t featureEncoding;
+    uint32_t rowStride;
+    uint32_t sampleCount;
+    uint32_t labelCount;
+    uint32_t reserved;
+    uint64_t samplesOffset;
+    uint64_t responsesOffset;
+    uint64_t labelsOffset;
+};
+
+static_assert(sizeof(ModelFileHeader) == 64, "ModelFileHeader must keep the samples 64 byte aligned.");
+
+/**
+ * Writes a model file one sample at a time, so models of any size can be
+ * written without holding them in memory. Only the labels are buffered.
+ */
+class ModelFileWriter {
+public:
+    /**
+    * @brief Open aFilepath for writing. Any existing file is truncated.
+    */
+    explicit ModelFileWriter(const std::string& aFilepath);
+    ~ModelFileWriter() = default;
+
+    bool isOpen() const;
+
+    /**
+    * @brief Append a sample to the model.
+    * @param aPackedRow Packed feature row of FEATURE_ROW_STRIDE bytes.
+    * @param aLabel Label of the sample.
+    */
+    void append(const uint8_t* aPackedRow, int aLabel);
+
+    /**
+    * @brief Write the labels and the header. No sample can be appended afterwards.
+    * @return false if any write failed.
+    */
+    bool finish();
+
+    int getSampleCount() const;
+
+private:
+    std::ofstream mFile;
+
+    // Label of every appended sample.
+    std::vector<int32_t> mResponses;
+};
+
+namespace ModelFile {
+    /**
+    * @brief Memory map a model file and wrap it in a BinaryKNearest without copying the samples.
+    * @param aFilepath Path to the .jpknn model.
+    * @param aLabelTable Optional output, the distinct labels stored in the model.
+    * @return The mapped model. Empty model if the file is missing or invalid.
+    */
+    cv::Ptr<BinaryKNearest> load(const std::string& aFilepath, std::vector<int>* aLabelTable = nullptr);
+
+    /**
+    * @brief Write the reference set of aModel to a model file.
+    * @return false if the file could not be written.
+    */
+    bool save(const BinaryKNearest& aModel, const std::string& aFilepath);
+
+    /**
+    * @brief Convert a serialized cv::ml::KNearest model (.opknn) to a model file.
+    * @param aOpknnFilepath Path to the OpenCV model.
+    * @param aFilepath Path of the model file to write.
+    * @return false if the OpenCV model could not be read or the model file could not be written.
+    */
+    bool convertFromOpknn(const std::string& aOpknnFilepath, const std::string& aFilepath);
+
+    /**
+    * @brief Append the samples of a sample log to a model file and delete the log. The model
+    * is rewritten next to aFilepath and then replaces it, so it must not be mapped meanwhile.
+    * The log is moved away before the model is replaced, its samples are never merged twice.
+    * An index built for the model no longer matches it afterwards.
+    * @param aFilepath Path to the .jpknn model.
+    * @param aLogFilepath Path to the log, see SampleLog.
+    * @return Number of samples merged, 0 if the log is missing or empty, -1 if the merge failed.
+    */
+    int mergeSampleLog(const std::string& aFilepath, const std::string& aLogFilepath);
+}
+
+#endif // !MODELFILE_HPP
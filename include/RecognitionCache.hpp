@@ -0,0 +1,74 @@
+#ifndef RECOGNITIONCACHE_HPP
+#define RECOGNITIONCACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+#include "RecognitionResult.hpp"
+
+/**
+ * Least recently used cache of recognition results, keyed by a fingerprint
+ * of the drawing. Recognizing a drawing again, e.g. comparing twice or undoing
+ * and redoing a stroke, is answered without running the pipeline.
+ *
+ * Not thread safe, used from the thread owning the RecognitionExecutor.
+ */
+class RecognitionCache {
+public:
+    /**
+     * 64 bit FNV-1a hash, fed with whatever identifies a drawing.
+     */
+    class Fingerprint {
+    public:
+        void add(const void* aData, size_t aSize);
+
+        template<typename T>
+        void add(const T& aValue) { add(&aValue, sizeof(aValue)); }
+
+        uint64_t value() const { return mHash; }
+
+    private:
+        uint64_t mHash = 14695981039346656037ull;
+    };
+
+    explicit RecognitionCache(size_t aCapacity = 64);
+
+    /**
+    * @brief Look a drawing up and mark it as the most recently used.
+    * Counts a hit or a miss.
+    */
+    std::optional<RecognitionResult> find(uint64_t aFingerprint);
+
+    /**
+    * @brief Store the result of a drawing, evicting the least recently used one if full.
+    */
+    void insert(uint64_t aFingerprint, const RecognitionResult& aResult);
+
+    void clear();
+
+    size_t size() const;
+
+    uint64_t getHits() const;
+
+    uint64_t getMisses() const;
+
+private:
+    using Entry = std::pair<uint64_t, RecognitionResult>;
+
+    size_t mCapacity;
+
+    // Most recently used first.
+    std::list<Entry> mEntries;
+
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> mIndex;
+
+    uint64_t mHits;
+
+    uint64_t mMisses;
+};
+
+#endif // !RECOGNITIONCACHE_HPP
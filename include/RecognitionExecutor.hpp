@@ -0,0 +1,193 @@
+#ifndef RECOGNITIONEXECUTOR_HPP
+#define RECOGNITIONEXECUTOR_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+#include <QImage>
+#include <QObject>
+#include <QRect>
+#include <QThreadPool>
+
+#include "opencv2/ml.hpp"
+
+#include "BinaryKNN.hpp"
+#include "ImageProcessMethods.hpp"
+#include "RecognitionCache.hpp"
+#include "RecognitionResult.hpp"
+
+/**
+ * Runs the recognition pipeline (readback, ROI rescaling and kNN search) on a
+ * worker pool so the GUI thread never waits on inference.
+ *
+ * Requests are latest-wins: submitting a new request supersedes every request
+ * still in flight. Superseded requests stop at their next stage boundary and
+ * their result is never delivered.
+ *
+ * Scales are evaluated from 1.0 outward, in small batches first, and the
+ * evaluation stops as soon as the label is clear. By default the scales of a
+ * batch are searched in parallel on WorkStealingPool::getShared(), a request
+ * then takes about as long as one scale per batch instead of all of them.
+ *
+ * Neighbours are cached per prepared feature, scales whose features did not change
+ * since an earlier request skip the kNN search. Whole results are cached per
+ * drawing fingerprint, a drawing recognized before is answered without any work.
+ */
+class RecognitionExecutor : public QObject {
+    Q_OBJECT
+public:
+    // Search result of a single scale.
+    struct ScaleResult {
+        int label;
+        std::array<float, KNN_NEIGHBOURS> neighbours;
+        std::array<float, KNN_NEIGHBOURS> distances;
+    };
+
+    // Search results of prepared features, keyed by a hash of the packed feature. Shared by the workers.
+    struct FeatureCache {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, ScaleResult> scales;
+    };
+
+    explicit RecognitionExecutor(QObject* parent = nullptr);
+
+    /**
+     * @brief Cancels every request in flight and waits for the workers to stop.
+     */
+    ~RecognitionExecutor();
+
+    /**
+    * @brief Set the models used by the next requests. Requests already in flight
+    * keep using the models they were submitted with.
+    */
+    void setModels(const cv::Ptr<BinaryKNearest>& aBinaryKnn, const cv::Ptr<cv::ml::KNearest>& aKnn);
+
+    /**
+    * @brief Forget every cached neighbour and result. Call after samples were added to the models.
+    */
+    void clearCaches();
+
+    /**
+    * @brief Queue a snapshot of the canvas for recognition. Supersedes older requests.
+    * @param aSnapshot Copy of the canvas. White background with black strokes.
+    * @param aInkBounds Area holding every stroke, the ROI is only searched there.
+    * A null rectangle searches the whole snapshot.
+    * @param aFingerprint Identifies the content of the snapshot, see RecognitionCache::Fingerprint.
+    * If a result is cached for it, recognized() is emitted before returning. 0 disables the cache.
+    * The delivered result carries it as RecognitionResult::fingerprint.
+    * @return Identifier of the request, increasing with every call.
+    */
+    quint64 submit(const QImage& aSnapshot, const QRect& aInkBounds = QRect(), quint64 aFingerprint = 0);
+
+    /**
+    * @brief Search the scales of a batch in parallel (default) or one after the other
+    * on the worker running the request. Both give the same results.
+    * Applies to the next requests.
+    */
+    void setParallelScales(bool aParallelScales);
+
+    /**
+    * @brief Cancel every request in flight.
+    */
+    void cancel();
+
+    /**
+    * @brief Results of earlier requests, with their hit and miss counters.
+    */
+    const RecognitionCache& getResultCache() const;
+
+    /**
+    * @brief The recognition pipeline after the readback, on the calling thread.
+    * Requests run it on a worker, it is public so the tests exercise the same code.
+    * @param aCanvas Inverted grayscale canvas (white strokes on black), see ImageMethods::qImageToInvertedGray().
+    * @param aSearchArea Area holding every stroke, the ROI is only searched there.
+    * An empty rectangle searches the whole canvas.
+    * @param aParallelScales Fan the scales of a batch out on WorkStealingPool::getShared().
+    * @param aFeatureCache Results of features searched before, shared between requests. Null searches every scale.
+    * @param aSuperseded Polled between stages, the pipeline stops once it returns true. Empty to never stop.
+    * @return The recognized drawing, or nothing if the request was superseded or failed.
+    * The label is -1 if the canvas holds nothing to recognize.
+    */
+    static std::optional<RecognitionResult> recognize(const cv::Mat& aCanvas, const cv::Rect& aSearchArea,
+                                                      const cv::Ptr<BinaryKNearest>& aBinaryKnn,
+                                                      const cv::Ptr<cv::ml::KNearest>& aKnn, bool aParallelScales,
+                                                      FeatureCache* aFeatureCache = nullptr,
+                                                      const std::function<bool()>& aSuperseded = {});
+
+    /**
+    * @brief Vote over the scales and rank every label seen among their neighbours.
+    * The predicted label is the one ImageMethods::findMostFrequentLabel() picks, it is
+    * always the first candidate. The others follow by votes, then by distance.
+    * @param aScales Search results of the evaluated scales, in evaluation order.
+    * @return The result, label -1 if aScales is empty.
+    */
+    static RecognitionResult buildResult(const std::vector<ScaleResult>& aScales);
+
+    /**
+    * @brief Whether the scales evaluated so far leave no doubt about the label: it leads the
+    * runner up by at least 3 scales, with a confidence of at least .75. recognize() stops
+    * searching the remaining scales once a partial result is clear.
+    */
+    static bool isClear(const RecognitionResult& aResult);
+
+signals:
+    /**
+     * @brief Delivers the result of the latest request, on the thread
+     * owning the executor. The label is -1 if nothing was drawn.
+     */
+    void recognized(const RecognitionResult& aResult);
+
+    /**
+     * @brief Internal. Emitted from a worker thread once a request is done.
+     */
+    void workerFinished(quint64 aRequest, quint64 aFingerprint, const RecognitionResult& aResult);
+
+private slots:
+    /**
+     * @brief Cache a worker result and forward it unless a newer request was submitted meanwhile.
+     */
+    void pDeliver(quint64 aRequest, quint64 aFingerprint, const RecognitionResult& aResult);
+
+private:
+    /**
+    * @brief Read the snapshot back and run recognize() on it. Runs on a worker thread.
+    * @param aInkBounds Area to search the ROI in, null to search the whole snapshot.
+    * @param aParallelScales Fan the scales of a batch out on the shared pool.
+    * @param aSuperseded Polled between stages, the pipeline stops once it returns true.
+    * @return See recognize().
+    */
+    static std::optional<RecognitionResult> pRecognize(const QImage& aSnapshot, const cv::Ptr<BinaryKNearest>& aBinaryKnn,
+                                         const cv::Ptr<cv::ml::KNearest>& aKnn, const QRect& aInkBounds,
+                                         FeatureCache& aFeatureCache, bool aParallelScales,
+                                         const std::function<bool()>& aSuperseded);
+
+private:
+    // Workers running the pipeline.
+    QThreadPool mPool;
+
+    // Identifier of the latest submitted request. Shared with the workers.
+    std::shared_ptr<std::atomic<quint64>> mLatestRequest;
+
+    cv::Ptr<BinaryKNearest> mBinaryKnn;
+
+    cv::Ptr<cv::ml::KNearest> mKnn;
+
+    // Replaced whenever the models change.
+    std::shared_ptr<FeatureCache> mFeatureCache;
+
+    // Only used on the thread owning the executor. Cleared whenever the models change.
+    RecognitionCache mResultCache;
+
+    // Latest request when the caches were last cleared, older results are not cached.
+    quint64 mCacheClearedAt = 0;
+
+    bool mParallelScales = true;
+};
+
+#endif // !RECOGNITIONEXECUTOR_HPP
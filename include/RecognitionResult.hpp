@@ -0,0 +1,44 @@
+#ifndef RECOGNITIONRESULT_HPP
+#define RECOGNITIONRESULT_HPP
+
+#include <vector>
+
+#include <QMetaType>
+
+/**
+ * Outcome of recognizing a drawing, with the runners up.
+ */
+struct RecognitionResult {
+    struct Candidate {
+        int label;
+
+        // Scales whose search predicted this label.
+        int votes;
+
+        // Smallest distance to a reference sample of this label, over every
+        // neighbour of every scale.
+        float distance;
+    };
+
+    // Predicted label, -1 if nothing was recognized.
+    int label = -1;
+
+    // Best candidates first, the first one is the predicted label.
+    std::vector<Candidate> candidates;
+
+    // Between 0 and 1. Share of the evaluated scales voting for the label, weighted
+    // by the share of their neighbours having the label.
+    float confidence = 0.0f;
+
+    // Distance to the nearest reference sample of every evaluated scale. Scales are
+    // evaluated from 1.0 outward and the evaluation stops once the label is clear,
+    // so there may be fewer than ROIRescaling() produces.
+    std::vector<float> distances;
+
+    // Fingerprint of the recognized drawing, see RecognitionExecutor::submit(). 0 if unknown.
+    quint64 fingerprint = 0;
+};
+
+Q_DECLARE_METATYPE(RecognitionResult)
+
+#endif // !RECOGNITIONRESULT_HPP
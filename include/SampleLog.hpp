@@ -0,0 +1,63 @@
+#ifndef SAMPLELOG_HPP
+#define SAMPLELOG_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+
+#include "BinaryKNN.hpp"
+
+/**
+* Append-only log of the samples added while the application runs, e.g. drawings
+* whose label was corrected by the user. A sample is written as soon as it is added,
+* which costs one record and never rewrites the file.
+*
+* The log is merged into the model file on the next startup, see ModelFile::mergeSampleLog().
+*
+* Layout, all values in host (little endian) byte order:
+*   SampleLogHeader    16 bytes
+*   records            int32 label followed by the FEATURE_BYTES bytes of the packed sample
+*/
+
+struct SampleLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t featureBytes;
+};
+
+static_assert(sizeof(SampleLogHeader) == 16, "SampleLogHeader must not be padded.");
+
+class SampleLog {
+public:
+    /**
+    * @brief Open aFilepath for appending, it is created if missing. A record cut
+    * short, e.g. by a crash while appending, is dropped first.
+    */
+    explicit SampleLog(const std::string& aFilepath);
+    ~SampleLog() = default;
+
+    bool isOpen() const;
+
+    /**
+    * @brief Write a sample at the end of the log and flush it.
+    * @param aPackedRow Packed feature row, see BinaryFeatures::packRow(). Padding bytes are not stored.
+    * @param aLabel Label of the sample.
+    * @return false if the write failed.
+    */
+    bool append(const uint8_t* aPackedRow, int aLabel);
+
+    /**
+    * @brief Read every complete record of a log.
+    * @param aPackedSamples N x FEATURE_ROW_STRIDE output matrix of CV_8U datatype.
+    * @param aLabels N output labels.
+    * @return false if the file is missing or is not a sample log.
+    */
+    static bool read(const std::string& aFilepath, cv::Mat& aPackedSamples, std::vector<int>& aLabels);
+
+private:
+    std::ofstream mFile;
+};
+
+#endif // !SAMPLELOG_HPP
@@ -2,6 +2,11 @@
 #define TESTCASES_TECHNIQUES_HPP
 
 #include "ImageProcessMethods.hpp"
+#include "BinaryKNN.hpp"
+#include "RecognitionExecutor.hpp"
+#include "SampleLog.hpp"
+#include "VPTreeIndex.hpp"
+#include "WorkStealingPool.hpp"
 
 #include "opencv2/core/mat.hpp"
 #include "opencv2/imgproc.hpp"
@@ -11,18 +16,38 @@
 #include <QString>
 #include <QRegularExpression>
 
+#include <array>
+#include <atomic>
 #include <vector>
 #include <tuple>
 #include <iostream>
 #include <algorithm>
 #include <map>
 #include <chrono>
+#include <functional>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 #include <gtest/gtest.h>
 
-using logEntry = std::tuple<QString, char, int, int, bool, double>;
+// PNG name, char, true label, calculated label, Equal?, time (ms), CPU time (ms)
+using logEntry = std::tuple<QString, char, int, int, bool, double, double>;
 
 using std::chrono::high_resolution_clock;
+using std::chrono::steady_clock;
 using std::chrono::duration_cast;
 using std::chrono::duration;
 using std::chrono::milliseconds;
@@ -33,6 +58,26 @@ using std::chrono::milliseconds;
 // This can be set to a different value.
 constexpr double ERROR_THRESHOLD = .90;
 
+// CPU time spent by the calling thread, in milliseconds. Unlike the wall clock it
+// does not count the time a thread waits for a core while the other workers run.
+double ThreadCpuTime() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+    ULARGE_INTEGER kernelTime, userTime;
+    kernelTime.LowPart = kernel.dwLowDateTime;
+    kernelTime.HighPart = kernel.dwHighDateTime;
+    userTime.LowPart = user.dwLowDateTime;
+    userTime.HighPart = user.dwHighDateTime;
+    // 100 ns units.
+    return (kernelTime.QuadPart + userTime.QuadPart) / 10000.0;
+#else
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+#endif
+}
+
 std::vector<std::pair<QString, cv::Mat>> LoadTestingImages() {
     QDir testingDir = QDir(QString("../testing"));
     QStringList imagesList = testingDir.entryList(QStringList() << "*.png" << "*.PNG", QDir::Files);
@@ -78,8 +123,97 @@ cv::Ptr<cv::ml::KNearest> LoadKNN() {
     return cv::ml::KNearest::load("../resource/kNN_ETL_Subset.opknn");
 }
 
-void LogTestData(const std::vector<logEntry>& aLogEntries, const char* aOutputFile, 
-    float aTotalTests, float aTotalSuccess, float aTotalFails, double aTotalTime, double aAverageTime) {
+cv::Ptr<BinaryKNearest> LoadBinaryKNN() {
+    return BinaryKNearest::load("../resource/kNN_ETL_Subset.opknn");
+}
+
+// Outcome of running a technique over the testing images.
+struct TechniqueRun {
+    // One entry per image, in the order of the images.
+    std::vector<logEntry> entries;
+
+    double totalTests = 0;
+    double totalSuccess = 0;
+    double totalFails = 0;
+
+    // Sums of the per image times (ms).
+    double totalTime = 0;
+    double totalCpuTime = 0;
+
+    // Time to run every image on the pool (ms).
+    double wallClockTime = 0;
+
+    unsigned threadCount = 0;
+
+    double successRate() const { return totalSuccess / totalTests; }
+
+    // Images per second.
+    double throughput() const { return totalTests / (wallClockTime / 1000.0); }
+};
+
+/**
+* @brief Run aTechnique on every testing image, spread over a work stealing pool.
+* Entries are written back in the order of aImages whatever order the images finish in.
+* @param aTechnique Preprocesses an image and returns the label calculated by the model.
+* Called concurrently, it must not modify shared state.
+*/
+TechniqueRun RunTechnique(const std::vector<std::pair<QString, cv::Mat>>& aImages,
+                          const std::map<char, int>& aLabelToChar,
+                          const std::function<int(const cv::Mat&)>& aTechnique) {
+    TechniqueRun run;
+    run.entries.resize(aImages.size());
+
+    QRegularExpression regexprPNG("(?<number>\\d+)_(?<character>\\w+).png");
+
+    // The pool already uses every core. OpenCV spreading a single search over other
+    // threads would oversubscribe them and hide that work from the per thread CPU time.
+    const int openCVThreads = cv::getNumThreads();
+    cv::setNumThreads(0);
+
+    auto startTime = steady_clock::now();
+    {
+        WorkStealingPool pool;
+        run.threadCount = pool.getThreadCount();
+
+        for(size_t index = 0; index < aImages.size(); ++index) {
+            const auto& imageInfo = aImages[index];
+            char characterLabel = regexprPNG.match(imageInfo.first).captured("character")[0].toLatin1();
+            int trueLabel = aLabelToChar.find(characterLabel)->second;
+
+            pool.submit([&run, &aTechnique, &imageInfo, index, characterLabel, trueLabel]() {
+                double cpuStart = ThreadCpuTime();
+                auto imageStart = steady_clock::now();
+                int kNNLabel = aTechnique(imageInfo.second);
+                duration<double, std::milli> db_time = steady_clock::now() - imageStart;
+                double cpuTime = ThreadCpuTime() - cpuStart;
+
+                run.entries[index] = std::make_tuple(imageInfo.first, characterLabel, trueLabel,
+                    kNNLabel, trueLabel == kNNLabel, db_time.count(), cpuTime);
+            });
+        }
+        pool.wait();
+    }
+    duration<double, std::milli> wallClock = steady_clock::now() - startTime;
+    run.wallClockTime = wallClock.count();
+
+    cv::setNumThreads(openCVThreads);
+
+    for(const logEntry& entry : run.entries) {
+        run.totalTime += std::get<5>(entry);
+        run.totalCpuTime += std::get<6>(entry);
+
+        if(std::get<4>(entry))
+            ++run.totalSuccess;
+        else
+            ++run.totalFails;
+
+        ++run.totalTests;
+    }
+
+    return run;
+}
+
+void LogTestData(const TechniqueRun& aRun, const char* aOutputFile) {
 
     QFile logFile = QFile(aOutputFile);
     logFile.open(QIODevice::ReadWrite | QIODevice::Text | QIODevice::Truncate);
@@ -87,26 +221,31 @@ void LogTestData(const std::vector<logEntry>& aLogEntries, const char* aOutputFi
     if(logFile.isOpen()) {
         QTextStream stream(&logFile);
 
-        double successRate = aTotalSuccess / aTotalTests;
-
         stream << "RESULTS [ TESTS : SUCCESS : FAILS ] -> " 
-            << "[ " << aTotalTests << " : " << aTotalSuccess << " : " << aTotalFails << " ]\n";
-        stream << "PERCENTAGE (SUCCESS/TESTS) -> " <<  successRate * 100.0 << "%\n";
-        stream << "TIME (ms) [ TOTAL : AVERAGE ] -> " << "[ " << aTotalTime << " : " << aAverageTime << " ]\n";
+            << "[ " << aRun.totalTests << " : " << aRun.totalSuccess << " : " << aRun.totalFails << " ]\n";
+        stream << "PERCENTAGE (SUCCESS/TESTS) -> " <<  aRun.successRate() * 100.0 << "%\n";
+        stream << "TIME (ms) [ TOTAL : AVERAGE ] -> " << "[ " << aRun.totalTime << " : "
+            << aRun.totalTime / aRun.totalTests << " ]\n";
+        stream << "CPU TIME (ms) [ TOTAL : AVERAGE ] -> " << "[ " << aRun.totalCpuTime << " : "
+            << aRun.totalCpuTime / aRun.totalTests << " ]\n";
+        stream << "WALL CLOCK [ THREADS : TIME (ms) : THROUGHPUT (images/s) ] -> " << "[ " << aRun.threadCount
+            << " : " << aRun.wallClockTime << " : " << aRun.throughput() << " ]\n";
 
 
         char character;
         int actualLabel;
         int calcLabel;
         double timeTaken;
+        double cpuTime;
         QString equal;
         QString pngName;
-        for(const logEntry& entry : aLogEntries) {
+        for(const logEntry& entry : aRun.entries) {
             pngName = std::get<0>(entry);
             character = std::get<1>(entry);
             actualLabel = std::get<2>(entry);
             calcLabel = std::get<3>(entry);
-            timeTaken = std::get<4>(entry);
+            timeTaken = std::get<5>(entry);
+            cpuTime = std::get<6>(entry);
 
             // Boolean value at index 4
             equal = "True";
@@ -114,139 +253,337 @@ void LogTestData(const std::vector<logEntry>& aLogEntries, const char* aOutputFi
                 equal = "False";
 
             stream << pngName << "," << character << "," << actualLabel << ","
-                << calcLabel << "," << equal << "," << timeTaken << "\n"; 
+                << calcLabel << "," << equal << "," << timeTaken << "," << cpuTime << "\n"; 
         }
 
     } else
         std::cerr << "[ INFODATA ] unable to open file: " << aOutputFile << "\n";
 }
 
+void PrintTestData(const TechniqueRun& aRun) {
+    std::cerr << "[ INFODATA ] RESULTS [ TESTS : SUCCESS : FAILS ] -> " 
+        << "[ " << aRun.totalTests << " : " << aRun.totalSuccess << " : " << aRun.totalFails << " ]\n";
+    std::cerr << "[ INFODATA ] PERCENTAGE (SUCCESS/TESTS) -> " <<  aRun.successRate() * 100.0 << "%\n";
+    std::cerr << "[ INFODATA ] TIME (ms) [ TOTAL : AVERAGE ] -> " << "[ " << aRun.totalTime << " : "
+        << aRun.totalTime / aRun.totalTests << " ]\n";
+    std::cerr << "[ INFODATA ] CPU TIME (ms) [ TOTAL : AVERAGE ] -> " << "[ " << aRun.totalCpuTime << " : "
+        << aRun.totalCpuTime / aRun.totalTests << " ]\n";
+    std::cerr << "[ INFODATA ] WALL CLOCK [ THREADS : TIME (ms) : THROUGHPUT (images/s) ] -> " << "[ "
+        << aRun.threadCount << " : " << aRun.wallClockTime << " : " << aRun.throughput() << " ]\n";
+}
+
 
 TEST(TechniqueTests, ROITranslocation) {
     std::vector<std::pair<QString, cv::Mat>> images = LoadTestingImages();
     std::map<char, int> labelToChar = LoadDictionary();
     cv::Ptr<cv::ml::KNearest>  kNN = LoadKNN();
 
-    // PNG name, char, true label, calculated label, Equal?
-    std::vector<logEntry> testEntries;
+    TechniqueRun run = RunTechnique(images, labelToChar, [&kNN](const cv::Mat& aImage) {
+        auto preparedImage = TechniqueMethods::ROITranslocation(aImage, false);
+        return ImageMethods::passThroughKNNModel(kNN, preparedImage);
+    });
 
-    QRegularExpression regexprPNG("(?<number>\\d+)_(?<character>\\w+).png");
-
-    int trueLabel = 0;
-    int kNNLabel = 0;
-    char characterLabel = '0';
+    ASSERT_TRUE( run.successRate() >= ERROR_THRESHOLD);
 
-    double totalTests = 0;
-    double totalSuccess = 0;
-    double totalFails = 0;
-
-    double totalTime = 0;
-    double timeTaken = 0;
-    auto startTime = high_resolution_clock::now();
-    auto endTime = high_resolution_clock::now();
-
-    for(const auto& imageInfo : images) {
-
-        characterLabel = regexprPNG.match(imageInfo.first).captured("character")[0].toLatin1();
-        trueLabel = labelToChar.find(characterLabel)->second;
-        
-        startTime = high_resolution_clock::now();
-        auto preparedImage = TechniqueMethods::ROITranslocation(imageInfo.second, false);
-        kNNLabel = ImageMethods::passThroughKNNModel(kNN, preparedImage);
-        endTime = high_resolution_clock::now();
-        duration<double, std::milli> db_time = endTime - startTime;
-        timeTaken = db_time.count();
+    PrintTestData(run);
+    LogTestData(run, "../ROITranslocation_Data.csv");
+}
 
-        testEntries.emplace_back(std::make_tuple(imageInfo.first, characterLabel, trueLabel, 
-            kNNLabel, trueLabel == kNNLabel, timeTaken));
+TEST(TechniqueTests, ROIRescaling) {
+    std::vector<std::pair<QString, cv::Mat>> images = LoadTestingImages();
+    std::map<char, int> labelToChar = LoadDictionary();
+    cv::Ptr<cv::ml::KNearest>  kNN = LoadKNN();
 
-        totalTime += timeTaken;
+    TechniqueRun run = RunTechnique(images, labelToChar, [&kNN](const cv::Mat& aImage) {
+        auto translocatedImage = TechniqueMethods::ROIRescaling(aImage, false);
+        return ImageMethods::passThroughKNNModel(kNN, translocatedImage);
+    });
 
-        if(trueLabel == kNNLabel)
-            ++totalSuccess;
-        else
-            ++totalFails;
+    ASSERT_TRUE( run.successRate() >= ERROR_THRESHOLD);
 
-        ++totalTests;
-    }
+    PrintTestData(run);
+    LogTestData(run, "../ROIRescaling_Data.csv");
+}
 
-    
-    double averageTime = totalTime / totalTests;
-    
-    double successRate = totalSuccess / totalTests;
+TEST(TechniqueTests, AdaptiveRecognition) {
+    std::vector<std::pair<QString, cv::Mat>> images = LoadTestingImages();
+    std::map<char, int> labelToChar = LoadDictionary();
+    cv::Ptr<BinaryKNearest> binaryKNN = LoadBinaryKNN();
+    ASSERT_FALSE(binaryKNN->empty());
+
+    // The pipeline of the application, which stops once the first scales agree.
+    std::atomic<size_t> evaluatedScales{0};
+    TechniqueRun run = RunTechnique(images, labelToChar, [&binaryKNN, &evaluatedScales](const cv::Mat& aImage) {
+        auto result = RecognitionExecutor::recognize(aImage, cv::Rect(), binaryKNN, nullptr, false);
+        if(!result)
+            return -1;
+        evaluatedScales += result->distances.size();
+        return result->label;
+    });
+
+    ASSERT_TRUE( run.successRate() >= ERROR_THRESHOLD);
+
+    PrintTestData(run);
+    std::cerr << "[ INFODATA ] SCALES EVALUATED (AVERAGE) -> " << evaluatedScales / run.totalTests << "\n";
+    LogTestData(run, "../AdaptiveRecognition_Data.csv");
+}
 
-    ASSERT_TRUE( successRate >= ERROR_THRESHOLD);
+RecognitionExecutor::ScaleResult MakeScaleResult(int aLabel, const std::array<float, KNN_NEIGHBOURS>& aNeighbours,
+                                                 const std::array<float, KNN_NEIGHBOURS>& aDistances) {
+    return RecognitionExecutor::ScaleResult{aLabel, aNeighbours, aDistances};
+}
 
-    std::cerr << "[ INFODATA ] RESULTS [ TESTS : SUCCESS : FAILS ] -> " 
-        << "[ " << totalTests << " : " << totalSuccess << " : " << totalFails << " ]\n";
-    std::cerr << "[ INFODATA ] PERCENTAGE (SUCCESS/TESTS) -> " <<  successRate * 100.0 << "%\n";
-    std::cerr << "[ INFODATA ] TIME (ms) [ TOTAL : AVERAGE ] -> " << "[ " << totalTime << " : " << averageTime << " ]\n";
+TEST(TechniqueTests, BuildResultRanksCandidates) {
+    std::vector<RecognitionExecutor::ScaleResult> scales = {
+        MakeScaleResult(5, {5, 5, 5, 7}, {10, 12, 14, 20}),
+        MakeScaleResult(5, {5, 5, 7, 5}, {11, 13, 15, 16}),
+        MakeScaleResult(7, {7, 7, 5, 9}, {9, 12, 13, 30}),
+        MakeScaleResult(5, {5, 5, 5, 5}, {8, 9, 9, 10}),
+    };
+    RecognitionResult result = RecognitionExecutor::buildResult(scales);
+
+    EXPECT_EQ(result.label, 5);
+    EXPECT_EQ(result.distances, (std::vector<float>{10, 11, 9, 8}));
+    // 3 of 4 scales vote for 5, their neighbours agree 3, 3 and 4 times out of 4.
+    EXPECT_FLOAT_EQ(result.confidence, .75f * (2.5f / 3.0f));
+
+    // The prediction first, then by votes, then by distance. 9 never won a scale.
+    ASSERT_EQ(result.candidates.size(), 3u);
+    EXPECT_EQ(result.candidates[0].label, 5);
+    EXPECT_EQ(result.candidates[0].votes, 3);
+    EXPECT_EQ(result.candidates[0].distance, 8.0f);
+    EXPECT_EQ(result.candidates[1].label, 7);
+    EXPECT_EQ(result.candidates[1].votes, 1);
+    EXPECT_EQ(result.candidates[1].distance, 9.0f);
+    EXPECT_EQ(result.candidates[2].label, 9);
+    EXPECT_EQ(result.candidates[2].votes, 0);
+    EXPECT_EQ(result.candidates[2].distance, 30.0f);
+
+    // Leading by 2 scales is not enough to stop early.
+    EXPECT_FALSE(RecognitionExecutor::isClear(result));
+
+    EXPECT_EQ(RecognitionExecutor::buildResult({}).label, -1);
+    EXPECT_FALSE(RecognitionExecutor::isClear(RecognitionResult()));
+}
 
-    LogTestData(testEntries, "../ROITranslocation_Data.csv", totalTests, totalSuccess, totalFails, totalTime, averageTime);
+TEST(TechniqueTests, EarlyExitNeedsAgreement) {
+    const auto agreeing = MakeScaleResult(5, {5, 5, 5, 5}, {8, 9, 9, 10});
+    const auto mostlyAgreeing = MakeScaleResult(5, {5, 5, 5, 7}, {8, 9, 9, 10});
+    const auto mostlyDisagreeing = MakeScaleResult(5, {5, 5, 7, 7}, {8, 9, 9, 10});
+
+    // Checked first after three scales, which must all agree.
+    EXPECT_TRUE(RecognitionExecutor::isClear(RecognitionExecutor::buildResult({agreeing, agreeing, agreeing})));
+    EXPECT_TRUE(RecognitionExecutor::isClear(
+        RecognitionExecutor::buildResult({mostlyAgreeing, mostlyAgreeing, mostlyAgreeing})));
+    EXPECT_FALSE(RecognitionExecutor::isClear(RecognitionExecutor::buildResult({agreeing, agreeing})));
+    // Confidence .5, the neighbours are split.
+    EXPECT_FALSE(RecognitionExecutor::isClear(
+        RecognitionExecutor::buildResult({mostlyDisagreeing, mostlyDisagreeing, mostlyDisagreeing})));
 }
 
-TEST(TechniqueTests, ROIRescaling) {
+TEST(TechniqueTests, BinaryKNNMatchesKNearest) {
     std::vector<std::pair<QString, cv::Mat>> images = LoadTestingImages();
-    std::map<char, int> labelToChar = LoadDictionary();
-    cv::Ptr<cv::ml::KNearest>  kNN = LoadKNN();
+    cv::Ptr<cv::ml::KNearest> kNN = LoadKNN();
+    cv::Ptr<BinaryKNearest> binaryKNN = LoadBinaryKNN();
 
-    // PNG name, char, true label, calculated label, Equal?
-    std::vector<logEntry> testEntries;
-    QRegularExpression reg_png("(?<number>\\d+)_(?<character>\\w+).png");
+    ASSERT_FALSE(binaryKNN->empty());
 
-    int trueLabel = 0;
-    int kNNLabel = 0;
-    char characterLabel = '0';
+    for(const auto& imageInfo : images) {
+        auto rescaledImages = TechniqueMethods::ROIRescaling(imageInfo.second, false);
+        cv::Mat distances, binaryDistances;
+        auto labels = ImageMethods::passThroughKNNModelBatch(kNN, rescaledImages, &distances);
+        auto binaryLabels = ImageMethods::passThroughKNNModelBatch(binaryKNN, rescaledImages, &binaryDistances);
+
+        // Features are 0/255, so the squared L2 distance is the hamming distance scaled by 255^2.
+        EXPECT_EQ(labels, binaryLabels) << imageInfo.first.toStdString();
+        cv::Mat scaledDistances = distances / (255.0 * 255.0);
+        EXPECT_LE(cv::norm(scaledDistances, binaryDistances, cv::NORM_INF), 0.5)
+            << imageInfo.first.toStdString();
+    }
+}
 
-    double totalTests = 0;
-    double totalSuccess = 0;
-    double totalFails = 0;
+TEST(TechniqueTests, VPTreeIndexHandlesDuplicates) {
+    // Learned samples (see BinaryKNearest::addSample()) repeat the same drawings,
+    // ties at the split distance must not leave one side of a node empty.
+    cv::Mat samples = cv::Mat::zeros(3000, FEATURE_ROW_STRIDE, CV_8U);
+    cv::Mat randomSamples = samples.rowRange(2000, 3000).colRange(0, FEATURE_BYTES);
+    cv::randu(randomSamples, 0, 256);
+    for(int row = 1000; row < 2000; ++row)
+        samples.row(2000).copyTo(samples.row(row));
+
+    cv::Ptr<VPTreeIndex> index = VPTreeIndex::build(samples);
+    ASSERT_EQ(index->getSampleCount(), samples.rows);
+
+    cv::Mat queries = cv::Mat::zeros(40, FEATURE_ROW_STRIDE, CV_8U);
+    cv::Mat randomQueries = queries.rowRange(20, 40).colRange(0, FEATURE_BYTES);
+    cv::randu(randomQueries, 0, 256);
+    samples.row(2000).copyTo(queries.row(1));
+    EXPECT_EQ(index->measureRecall(samples, queries, KNN_NEIGHBOURS), 1.0);
+}
 
-    double totalTime = 0;
-    double timeTaken = 0;
-    auto startTime = high_resolution_clock::now();
-    auto endTime = high_resolution_clock::now();
+TEST(TechniqueTests, VPTreeIndexRejectsCorruptFiles) {
+    cv::Mat samples = cv::Mat::zeros(300, FEATURE_ROW_STRIDE, CV_8U);
+    cv::Mat randomSamples = samples.colRange(0, FEATURE_BYTES);
+    cv::randu(randomSamples, 0, 256);
+    cv::Ptr<VPTreeIndex> index = VPTreeIndex::build(samples);
+    const std::string path = "../VPTreeIndex_Test.vpt";
+
+    // Saves the index with the 32 bit value at aOffset replaced, a negative offset counts from the end.
+    auto loadPatched = [&](std::streamoff aOffset, int32_t aValue) {
+        EXPECT_TRUE(index->save(path));
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(aOffset, aOffset < 0 ? std::ios::end : std::ios::beg);
+        file.write(reinterpret_cast<const char*>(&aValue), sizeof(aValue));
+        file.close();
+        return VPTreeIndex::load(path);
+    };
+
+    ASSERT_TRUE(index->save(path));
+    EXPECT_EQ(VPTreeIndex::load(path)->getSampleCount(), samples.rows);
+    // The header is 32 bytes, the root node follows: vantage, radius, inside, outside.
+    EXPECT_TRUE(loadPatched(20, 1 << 30)->empty()) << "node count";
+    EXPECT_TRUE(loadPatched(32, samples.rows)->empty()) << "vantage point";
+    EXPECT_TRUE(loadPatched(40, 0)->empty()) << "child pointing back to the root";
+    EXPECT_TRUE(loadPatched(-4, samples.rows)->empty()) << "item";
+    std::remove(path.c_str());
+}
 
-    for(const auto& imageInfo : images) {
-        
-        characterLabel = reg_png.match(imageInfo.first).captured("character")[0].toLatin1();
-        trueLabel = labelToChar.find(characterLabel)->second;
+TEST(TechniqueTests, ObtainROIMatchesPixelScan) {
+    std::vector<std::pair<QString, cv::Mat>> images = LoadTestingImages();
 
-        startTime = high_resolution_clock::now();
-        auto translocatedImage = TechniqueMethods::ROIRescaling(imageInfo.second, false);
-        kNNLabel = ImageMethods::passThroughKNNModel(kNN, translocatedImage);
-        endTime = high_resolution_clock::now();
-        duration<double, std::milli> db_time = endTime - startTime;
-        timeTaken = db_time.count();
+    for(const auto& imageInfo : images) {
+        const cv::Mat& image = imageInfo.second;
+        int min_x = INT32_MAX, min_y = INT32_MAX, max_x = -1, max_y = -1;
+        for(int y = 0; y < image.rows; ++y) {
+            for(int x = 0; x < image.cols; ++x) {
+                if(image.at<uchar>(y, x) == 255) {
+                    min_x = std::min(min_x, x);
+                    max_x = std::max(max_x, x);
+                    min_y = std::min(min_y, y);
+                    max_y = std::max(max_y, y);
+                }
+            }
+        }
+        if(max_x < 0)
+            continue;
+        cv::Rect expected(min_x, min_y, max_x - min_x, max_y - min_y);
+
+        EXPECT_EQ(ImageMethods::obtainROI(image), expected) << imageInfo.first.toStdString();
+        // A search area holding the character, as tracked while drawing, gives the same ROI.
+        cv::Rect searchArea(expected.x - 8, expected.y - 8, expected.width + 17, expected.height + 17);
+        EXPECT_EQ(ImageMethods::obtainROI(image, searchArea), expected) << imageInfo.first.toStdString();
+    }
+}
 
-        testEntries.emplace_back(std::make_tuple(imageInfo.first, characterLabel, trueLabel, 
-            kNNLabel, trueLabel == kNNLabel, timeTaken));
+// Fraction of the feature pixels allowed to differ between the fused and the unfused
+// preprocessing. Both resample the strokes differently, only their edges may flip.
+constexpr double FUSED_FEATURE_TOLERANCE = .03;
 
-        totalTime += timeTaken;
+TEST(TechniqueTests, FusedRescalingMatchesROIRescaling) {
+    std::vector<std::pair<QString, cv::Mat>> images = LoadTestingImages();
+    ImageMethods::FeatureWorkspace workspace;
 
-        if(trueLabel == kNNLabel)
-            ++totalSuccess;
-        else
-            ++totalFails;
+    for(const auto& imageInfo : images) {
+        cv::Rect roi = ImageMethods::obtainROI(imageInfo.second);
+        if(roi.empty())
+            continue;
+
+        cv::Mat expected = ImageMethods::prepareBatchForKNN(TechniqueMethods::ROIRescaling(imageInfo.second, roi, false));
+        cv::Mat features = TechniqueMethods::ROIRescalingFeatures(imageInfo.second, roi, workspace);
+        ASSERT_EQ(features.rows, expected.rows) << imageInfo.first.toStdString();
+
+        for(int row = 0; row < features.rows; ++row) {
+            double differing = cv::norm(features.row(row), expected.row(row), cv::NORM_L1) / 255.0;
+            EXPECT_LE(differing / features.cols, FUSED_FEATURE_TOLERANCE)
+                << imageInfo.first.toStdString() << " scale " << row;
+        }
 
-        ++totalTests;
+        // The workspace is reused, not reallocated, whatever the number of scales.
+        const uchar* buffer = workspace.features.data;
+        TechniqueMethods::ROIRescalingFeatures(imageInfo.second, roi, workspace);
+        EXPECT_EQ(workspace.features.data, buffer);
+        EXPECT_LE(ImageMethods::rescaleROIToFeatures({1.0f}, imageInfo.second, roi, workspace).rows, 1);
+        EXPECT_EQ(workspace.features.data, buffer);
+        EXPECT_LE(ImageMethods::rescaleROIToFeatures({.95f, 1.05f}, imageInfo.second, roi, workspace).rows, 2);
+        EXPECT_EQ(workspace.features.data, buffer);
     }
+}
 
-    double averageTime = totalTime / totalTests;
-
-    double successRate = totalSuccess / totalTests;
 
-    ASSERT_TRUE( successRate >= ERROR_THRESHOLD);
+void ExpectSameResult(const RecognitionResult& aExpected, const RecognitionResult& aActual, const QString& aImage) {
+    const std::string image = aImage.toStdString();
+    EXPECT_EQ(aActual.label, aExpected.label) << image;
+    EXPECT_EQ(aActual.confidence, aExpected.confidence) << image;
+    EXPECT_EQ(aActual.distances, aExpected.distances) << image;
+    ASSERT_EQ(aActual.candidates.size(), aExpected.candidates.size()) << image;
+    for(size_t candidate = 0; candidate < aExpected.candidates.size(); ++candidate) {
+        EXPECT_EQ(aActual.candidates[candidate].label, aExpected.candidates[candidate].label) << image;
+        EXPECT_EQ(aActual.candidates[candidate].votes, aExpected.candidates[candidate].votes) << image;
+        EXPECT_EQ(aActual.candidates[candidate].distance, aExpected.candidates[candidate].distance) << image;
+    }
+}
 
-    // testing::internal::CaptureStdout();
+TEST(TechniqueTests, ParallelScalesMatchSerial) {
+    std::vector<std::pair<QString, cv::Mat>> images = LoadTestingImages();
+    cv::Ptr<BinaryKNearest> binaryKNN = LoadBinaryKNN();
+    ASSERT_FALSE(binaryKNN->empty());
+    RecognitionExecutor::FeatureCache featureCache;
 
-    std::cerr << "[ INFODATA ] RESULTS [ TESTS : SUCCESS : FAILS ] -> " 
-        << "[ " << totalTests << " : " << totalSuccess << " : " << totalFails << " ]\n";
-    std::cerr << "[ INFODATA ] PERCENTAGE (SUCCESS/TESTS) -> " <<  successRate * 100.0 << "%\n";
-    std::cerr << "[ INFODATA ] TIME (ms) [ TOTAL : AVERAGE ] -> " << "[ " << totalTime << " : " << averageTime << " ]\n";
+    for(const auto& imageInfo : images) {
+        auto serial = RecognitionExecutor::recognize(imageInfo.second, cv::Rect(), binaryKNN, nullptr, false);
+        auto parallel = RecognitionExecutor::recognize(imageInfo.second, cv::Rect(), binaryKNN, nullptr, true);
+        ASSERT_TRUE(serial && parallel) << imageInfo.first.toStdString();
+        ExpectSameResult(*serial, *parallel, imageInfo.first);
+
+        // The second request finds every searched scale in the cache.
+        for(int request = 0; request < 2; ++request) {
+            auto cached = RecognitionExecutor::recognize(imageInfo.second, cv::Rect(), binaryKNN, nullptr, true,
+                                                         &featureCache);
+            ASSERT_TRUE(cached) << imageInfo.first.toStdString();
+            ExpectSameResult(*serial, *cached, imageInfo.first);
+        }
+    }
+}
 
 
-    LogTestData(testEntries, "../ROIRescaling_Data.csv", totalTests, totalSuccess, totalFails, totalTime, averageTime);
+TEST(TechniqueTests, AddedSamplesAreSearched) {
+    std::vector<std::pair<QString, cv::Mat>> images = LoadTestingImages();
+    cv::Ptr<BinaryKNearest> binaryKNN = LoadBinaryKNN();
+    ASSERT_FALSE(images.empty());
+    ASSERT_FALSE(binaryKNN->empty());
+
+    const cv::Mat& image = images.front().second;
+    ImageMethods::FeatureWorkspace workspace;
+    cv::Mat features = ImageMethods::rescaleROIToFeatures({1.0f}, image, ImageMethods::obtainROI(image), workspace);
+    ASSERT_FALSE(features.empty());
+    uint8_t packed[FEATURE_ROW_STRIDE];
+    BinaryFeatures::packRow(features.row(0), packed);
+
+    // No reference sample has this label.
+    const int label = 1000;
+    const std::string logFilepath = "../SampleLog_Test.log";
+    std::remove(logFilepath.c_str());
+    {
+        SampleLog log(logFilepath);
+        ASSERT_TRUE(log.append(packed, label));
+    }
+    cv::Mat logSamples;
+    std::vector<int> logLabels;
+    ASSERT_TRUE(SampleLog::read(logFilepath, logSamples, logLabels));
+    std::remove(logFilepath.c_str());
+    ASSERT_EQ(logLabels, std::vector<int>{label});
+    EXPECT_EQ(std::memcmp(logSamples.ptr<uint8_t>(0), packed, FEATURE_ROW_STRIDE), 0);
+
+    ASSERT_TRUE(binaryKNN->addSample(logSamples.ptr<uint8_t>(0), logLabels[0]));
+    EXPECT_EQ(binaryKNN->getAddedSampleCount(), 1);
+
+    // The added sample is at distance 0, among the nearest neighbours whatever ties there are.
+    cv::Mat results, neighbours, distances;
+    binaryKNN->findNearest(features, KNN_NEIGHBOURS, results, neighbours, distances);
+    bool found = false;
+    for(int neighbour = 0; neighbour < neighbours.cols; ++neighbour)
+        found |= neighbours.at<float>(0, neighbour) == label && distances.at<float>(0, neighbour) == 0.0f;
+    EXPECT_TRUE(found);
 }
 
-#endif
\ No newline at end of file
+#endif
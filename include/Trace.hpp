@@ -0,0 +1,105 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+* Latency spans of the recognition pipeline.
+*
+* A span times the scope it is declared in and records the duration in a histogram
+* owned by the calling thread. Recording never takes a lock: every thread only writes
+* to its own histograms and event buffer, readers merge them on demand.
+*
+* The last EVENT_CAPACITY spans of every thread are also kept so they can be exported
+* as Chrome trace events (chrome://tracing, Perfetto) to look at single slow requests.
+*
+* Spans are declared with TRACE_SPAN(), which compiles to nothing unless ENABLE_TRACING
+* is defined (see the ENABLE_TRACING CMake option).
+*/
+namespace Trace {
+    enum class Stage : uint8_t {
+        // A whole request, from readback to the label.
+        Recognition,
+        Readback,
+        ROIExtraction,
+        Rescaling,
+        FeaturePreparation,
+        KNNSearch,
+        Voting,
+        Count
+    };
+
+    // Spans kept per thread for the trace export, older ones are overwritten.
+    constexpr size_t EVENT_CAPACITY = 4096;
+
+    const char* stageName(Stage aStage);
+
+    /**
+    * @brief Monotonic time in nanoseconds.
+    */
+    uint64_t now();
+
+    /**
+    * @brief Record a span of aStage on the calling thread.
+    */
+    void record(Stage aStage, uint64_t aStart, uint64_t aEnd);
+
+    /**
+    * Records the time between its construction and destruction. Use TRACE_SPAN().
+    */
+    class Span {
+    public:
+        explicit Span(Stage aStage) : mStage(aStage), mStart(now()) {}
+
+        ~Span() { record(mStage, mStart, now()); }
+
+        Span(Span const&) = delete;
+        void operator=(Span const&) = delete;
+
+    private:
+        Stage mStage;
+        uint64_t mStart;
+    };
+
+    // Latency of a stage over every thread, in microseconds.
+    struct Summary {
+        Stage stage;
+        uint64_t count;
+        double p50;
+        double p95;
+        double p99;
+        double max;
+    };
+
+    /**
+    * @brief Merge the histograms of every thread. Percentiles are accurate to about 3%.
+    * @return One summary per stage that recorded at least one span.
+    */
+    std::vector<Summary> summarize();
+
+    /**
+    * @brief Write the summaries as a table, one stage per line.
+    */
+    void dumpSummary(std::ostream& aStream);
+
+    /**
+    * @brief Write the recorded spans of every thread as Chrome trace event JSON.
+    * Spans recorded while writing may be skipped.
+    * @return false if the file could not be written.
+    */
+    bool writeChromeTrace(const std::string& aFilepath);
+}
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+
+#ifdef ENABLE_TRACING
+#define TRACE_SPAN(aStage) Trace::Span TRACE_CONCAT(traceSpan, __LINE__)(Trace::Stage::aStage)
+#else
+#define TRACE_SPAN(aStage) ((void)0)
+#endif
+
+#endif // !TRACE_HPP
@@ -0,0 +1,117 @@
+#ifndef VPTREEINDEX_HPP
+#define VPTREEINDEX_HPP
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include "opencv2/core.hpp"
+
+/**
+ * Vantage point tree over bit packed feature rows (see BinaryKNN.hpp), using the
+ * hamming distance. The index only stores the tree structure and sample indices,
+ * the samples themselves are owned by the model the index was built for.
+ *
+ * The index is built offline (see tools/BuildIndex.cpp) and stored next to the model.
+ *
+ * Searching is best-first. With no search budget the search is exact. Setting a budget
+ * bounds the number of distance evaluations per query, trading recall for latency.
+ * The budget is stored with the index, so it is picked when the index is built.
+ */
+class VPTreeIndex {
+public:
+    // (hamming distance, sample index)
+    using Neighbour = std::pair<uint32_t, int>;
+
+    VPTreeIndex() = default;
+    ~VPTreeIndex() = default;
+
+    /**
+    * @brief Build an index over the packed samples.
+    * @param aPackedSamples N x FEATURE_ROW_STRIDE matrix of packed samples.
+    * @param aLeafSize Maximum number of samples kept in a leaf.
+    * @param aSeed Seed used to select vantage points.
+    * @return The built index.
+    */
+    static cv::Ptr<VPTreeIndex> build(const cv::Mat& aPackedSamples, int aLeafSize = 16, uint32_t aSeed = 5489u);
+
+    /**
+    * @brief Load an index written by save().
+    * @param aFilepath Path to the index file.
+    * @return The loaded index. Empty index if the file could not be read.
+    */
+    static cv::Ptr<VPTreeIndex> load(const std::string& aFilepath);
+
+    /**
+    * @brief Write the index to disk, along with its search budget.
+    * @param aFilepath Path to the index file.
+    * @return false if the file could not be written.
+    */
+    bool save(const std::string& aFilepath) const;
+
+    /**
+    * @brief Find the aK nearest samples to aQuery.
+    * @param aPackedSamples The samples the index was built for.
+    * @param aQuery Packed query row of FEATURE_ROW_STRIDE bytes.
+    * @param aK Number of neighbours to find.
+    * @param aNeighbours Output. Up to aK neighbours sorted by (distance, sample index).
+    */
+    void search(const cv::Mat& aPackedSamples, const uint8_t* aQuery, int aK,
+                std::vector<Neighbour>& aNeighbours) const;
+
+    /**
+    * @brief Bound the number of distance evaluations a single query may use.
+    * Lower values reduce latency at the cost of recall.
+    * @param aMaxDistanceEvaluations Maximum evaluations per query. 0 makes the search exact.
+    */
+    void setSearchBudget(int aMaxDistanceEvaluations);
+
+    int getSearchBudget() const;
+
+    /**
+    * @brief Measure recall@aK of the current search budget against an exact brute force search.
+    * @param aPackedSamples The samples the index was built for.
+    * @param aPackedQueries M x FEATURE_ROW_STRIDE matrix of packed queries.
+    * @param aK Number of neighbours to compare.
+    * @return Fraction of the exact neighbours that were also returned by the index.
+    */
+    double measureRecall(const cv::Mat& aPackedSamples, const cv::Mat& aPackedQueries, int aK) const;
+
+    /**
+    * @brief Number of samples the index was built for.
+    */
+    int getSampleCount() const;
+
+    bool empty() const;
+
+private:
+    struct Node {
+        // Sample used as the vantage point. -1 for leaves.
+        int32_t vantage;
+        // Samples with a distance to the vantage point <= radius are in the inside child.
+        uint32_t radius;
+        // Inside child node. For leaves, the first position in mItems.
+        int32_t inside;
+        // Outside child node. For leaves, the number of items.
+        int32_t outside;
+    };
+
+    int32_t pBuildNode(const cv::Mat& aPackedSamples, int aBegin, int aEnd, std::vector<uint32_t>& aScratch,
+                       uint32_t& aRandomState);
+
+private:
+    // Flattened tree, the root is at index 0.
+    std::vector<Node> mNodes;
+
+    // Sample indices referenced by the leaves.
+    std::vector<int32_t> mItems;
+
+    int mSampleCount = 0;
+
+    int mLeafSize = 16;
+
+    // Maximum distance evaluations per query. 0 for exact search.
+    int mSearchBudget = 0;
+};
+
+#endif // !VPTREEINDEX_HPP
@@ -0,0 +1,115 @@
+#ifndef WORKSTEALINGPOOL_HPP
+#define WORKSTEALINGPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed size thread pool where every worker owns a queue of tasks.
+ *
+ * Workers run their own tasks newest first and, once out of work, steal
+ * the oldest task of another worker. Tasks submitted from outside the pool
+ * are spread over the queues round robin. Uneven task costs (e.g. images of
+ * very different sizes) are balanced without a single shared queue every
+ * worker contends on.
+ *
+ * Only depends on the standard library, so it can be used by the headless tools.
+ */
+class WorkStealingPool {
+public:
+    /**
+    * @brief Start the workers.
+    * @param aThreadCount Number of workers. 0 uses one worker per hardware thread.
+    */
+    explicit WorkStealingPool(unsigned aThreadCount = 0);
+
+    /**
+    * @brief Wait for every submitted task, then stop the workers.
+    */
+    ~WorkStealingPool();
+
+    WorkStealingPool(WorkStealingPool const&) = delete;
+    void operator=(WorkStealingPool const&) = delete;
+
+    /**
+    * @brief Queue a task. Tasks submitted by a worker go to its own queue.
+    */
+    void submit(std::function<void()> aTask);
+
+    /**
+    * @brief Run aBody(0) ... aBody(aCount - 1) on the pool and return once all of them
+    * finished. The calling thread runs indices too, so it can be called from a task
+    * of this pool without starving it. Indices are handed out in order to whichever
+    * thread is free, aBody must only write to state owned by its index.
+    * If aBody threw, the first exception is rethrown here.
+    */
+    void parallelFor(size_t aCount, const std::function<void(size_t)>& aBody);
+
+    /**
+    * @brief Pool shared by the whole process, with one worker per hardware thread.
+    * Created on first use.
+    */
+    static WorkStealingPool& getShared();
+
+    /**
+    * @brief Block until every submitted task has finished. Must not be called from a task.
+    * If a task threw, the first exception is rethrown here.
+    */
+    void wait();
+
+    unsigned getThreadCount() const;
+
+    /**
+    * @brief Index of the worker running the calling thread, -1 outside of the pool.
+    */
+    static int currentWorker();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void pRun(unsigned aIndex);
+
+    /**
+    * @brief Take the newest task of worker aIndex, or steal the oldest task of another worker.
+    * @return false if every queue is empty.
+    */
+    bool pTake(unsigned aIndex, std::function<void()>& aTask);
+
+private:
+    std::vector<std::unique_ptr<Queue>> mQueues;
+
+    std::vector<std::thread> mThreads;
+
+    // Guards sleeping and waking up, the queues have their own locks.
+    std::mutex mMutex;
+
+    std::condition_variable mWorkAvailable;
+
+    std::condition_variable mAllDone;
+
+    // Tasks sitting in a queue.
+    std::atomic<size_t> mQueued;
+
+    // Tasks submitted and not finished yet.
+    std::atomic<size_t> mPending;
+
+    // Queue receiving the next task submitted from outside the pool.
+    std::atomic<unsigned> mNextQueue;
+
+    bool mStopping;
+
+    // First exception thrown by a task since the last wait().
+    std::exception_ptr mException;
+};
+
+#endif // !WORKSTEALINGPOOL_HPP
@@ -6,6 +6,9 @@
 #include <QPointer>
 
 #include "Log.hpp"
+#include "RecognitionResult.hpp"
+
+#include <vector>
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
@@ -17,7 +20,9 @@ class QPixmap;
 
 class DrawArea;
 class QPushButton;
+class QCheckBox;
 class QLabel;
+class QToolButton;
 
 class MainWindow : public QMainWindow
 {
@@ -35,14 +40,54 @@ public slots:
     */
     void compareLayer(bool);
 
+    /**
+    * @brief Display the character predicted
+    * for the drawn layer.
+    * @param aLabel numeric value representing a label for a character,
+    * -1 clears the prediction.
+    */
+    void showPrediction(int aLabel);
+
+    /**
+    * @brief Display the confidence of the prediction and
+    * the runner up characters. Clicking a runner up corrects
+    * the prediction, see DrawArea::learnDrawing().
+    * @param aResult result of recognizing the drawn layer.
+    */
+    void showAlternatives(const RecognitionResult& aResult);
+
+    /**
+    * @brief Disable the runner up characters, they belong to
+    * a drawing that has changed since.
+    */
+    void disableAlternatives();
+
     /**
     * @brief Capture key combinations:
     * ctrl-z : undo
+    * ctrl-y, ctrl-shift-z : redo
+    * ctrl-t : dump the recognition latency trace
     */
     void keyPressEvent(QKeyEvent* event) override;
     void keyReleaseEvent(QKeyEvent* event) override;
 
+    /**
+    * @brief Log the latency percentiles of every recognition stage and the
+    * recognition cache counters, then write the recorded spans to
+    * TRACE_OUTPUT_FILE as a Chrome trace.
+    */
+    void dumpTrace();
+
 private:
+    static inline const char* TRACE_OUTPUT_FILE = "../Trace.json";
+
+    // Runner up characters shown below the prediction.
+    static constexpr int ALTERNATIVE_COUNT = 4;
+
+    // Width and height of a runner up character.
+    static constexpr int ALTERNATIVE_SIZE = 64;
+
+
     // Main GUI window pointer.
     Ui::MainWindow *mUi;
 
@@ -54,10 +99,31 @@ private:
     // according to the model.
     QLabel* mPredictionArea;
 
+    // Confidence of the predicted character.
+    QLabel* mConfidenceLabel;
+
+    // Holds the runner up characters.
+    QWidget* mAlternativesArea;
+
+    // Runner up characters, best first. Clicking one adds
+    // the drawing to the model as that character.
+    std::vector<QToolButton*> mAlternativeButtons;
+
+    // Label shown by each runner up button, -1 if none.
+    std::vector<int> mAlternativeCandidates;
+
+    // Fingerprint of the drawing the runner up characters
+    // were recognized from, see DrawArea::learnDrawing().
+    quint64 mAlternativesFingerprint;
+
     // Button to initiate passing current
     // drawn image to the model.
     QPushButton* mCompareButton;
 
+    // Toggles recognition of the drawing after
+    // every stroke.
+    QCheckBox* mLiveCheckBox;
+
     // indicate that the ctrl key has been pressed.
     bool mCtrlKey_modifier;
 
@@ -0,0 +1,421 @@
+#include "BinaryKNN.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <climits>
+#include <cstring>
+#include <mutex>
+#include <utility>
+
+#include <QString>
+
+#include "Log.hpp"
+#include "VPTreeIndex.hpp"
+
+// The SIMD kernels rely on GCC/Clang target attributes and cpu detection builtins.
+// Other compilers use the scalar kernel.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BINARYKNN_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define BINARYKNN_X86_KERNELS 0
+#endif
+
+static_assert(FEATURE_ROW_STRIDE % 64 == 0, "Packed rows must be a multiple of 64 bytes.");
+
+namespace {
+    // Number of reference rows compared against every query before moving on to the next
+    // block. A block (80 KB) stays in cache while all queries of a batch are scanned over it,
+    // so the reference set is only streamed from memory once per batch.
+    constexpr size_t BLOCK_ROWS = 256;
+
+    using HammingKernel = void (*)(const uint8_t*, const uint8_t*, size_t, uint32_t*);
+
+    struct KernelChoice {
+        HammingKernel kernel;
+        const char* name;
+    };
+
+    uint32_t
+    pPopcount64(uint64_t aValue) {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<uint32_t>(__builtin_popcountll(aValue));
+#else
+        return static_cast<uint32_t>(std::bitset<64>(aValue).count());
+#endif
+    }
+
+    void
+    pHammingScalar(const uint8_t* aQuery, const uint8_t* aRows, size_t aCount, uint32_t* aDistances) {
+        for(size_t row = 0; row < aCount; ++row) {
+            const uint8_t* sample = aRows + row * FEATURE_ROW_STRIDE;
+            uint32_t distance = 0;
+            for(int offset = 0; offset < FEATURE_ROW_STRIDE; offset += 8) {
+                uint64_t queryWord, sampleWord;
+                std::memcpy(&queryWord, aQuery + offset, sizeof(uint64_t));
+                std::memcpy(&sampleWord, sample + offset, sizeof(uint64_t));
+                distance += pPopcount64(queryWord ^ sampleWord);
+            }
+            aDistances[row] = distance;
+        }
+    }
+
+#if BINARYKNN_X86_KERNELS
+    // Nibble lookup popcount (Mula et al.), summed per 64 bit lane with sad_epu8.
+    __attribute__((target("avx2"))) void
+    pHammingAVX2(const uint8_t* aQuery, const uint8_t* aRows, size_t aCount, uint32_t* aDistances) {
+        const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i lowMask = _mm256_set1_epi8(0x0f);
+        const __m256i zero = _mm256_setzero_si256();
+
+        for(size_t row = 0; row < aCount; ++row) {
+            const uint8_t* sample = aRows + row * FEATURE_ROW_STRIDE;
+            __m256i total = _mm256_setzero_si256();
+            for(int offset = 0; offset < FEATURE_ROW_STRIDE; offset += 32) {
+                __m256i bits = _mm256_xor_si256(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(aQuery + offset)),
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sample + offset)));
+                __m256i low = _mm256_and_si256(bits, lowMask);
+                __m256i high = _mm256_and_si256(_mm256_srli_epi16(bits, 4), lowMask);
+                __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low),
+                                                 _mm256_shuffle_epi8(lookup, high));
+                total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, zero));
+            }
+            // _mm256_extract_epi64 only exists on x86-64, the lanes are summed from memory instead.
+            alignas(32) uint64_t lanes[4];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), total);
+            aDistances[row] = static_cast<uint32_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+        }
+    }
+
+    __attribute__((target("avx512f,avx512vpopcntdq"))) void
+    pHammingAVX512(const uint8_t* aQuery, const uint8_t* aRows, size_t aCount, uint32_t* aDistances) {
+        for(size_t row = 0; row < aCount; ++row) {
+            const uint8_t* sample = aRows + row * FEATURE_ROW_STRIDE;
+            __m512i total = _mm512_setzero_si512();
+            for(int offset = 0; offset < FEATURE_ROW_STRIDE; offset += 64) {
+                __m512i bits = _mm512_xor_si512(_mm512_loadu_si512(aQuery + offset),
+                                                _mm512_loadu_si512(sample + offset));
+                total = _mm512_add_epi64(total, _mm512_popcnt_epi64(bits));
+            }
+            alignas(64) uint64_t lanes[8];
+            _mm512_store_si512(lanes, total);
+            aDistances[row] = static_cast<uint32_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+                                                    lanes[4] + lanes[5] + lanes[6] + lanes[7]);
+        }
+    }
+#endif
+
+    KernelChoice
+    pSelectKernel() {
+#if BINARYKNN_X86_KERNELS
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+            return {pHammingAVX512, "avx512-vpopcntdq"};
+        if(__builtin_cpu_supports("avx2"))
+            return {pHammingAVX2, "avx2"};
+#endif
+        return {pHammingScalar, "scalar"};
+    }
+
+    const KernelChoice&
+    pKernel() {
+        static const KernelChoice choice = pSelectKernel();
+        return choice;
+    }
+
+    // Majority vote over the labels of the nearest neighbours. Ties resolve toward
+    // the smaller label, matching cv::ml::KNearest.
+    float
+    pVote(std::vector<int>& aLabels) {
+        std::sort(aLabels.begin(), aLabels.end());
+        int bestLabel = 0;
+        size_t bestCount = 0;
+        size_t runStart = 0;
+        for(size_t index = 1; index <= aLabels.size(); ++index) {
+            if(index == aLabels.size() || aLabels[index] != aLabels[index - 1]) {
+                if(index - runStart > bestCount) {
+                    bestCount = index - runStart;
+                    bestLabel = aLabels[index - 1];
+                }
+                runStart = index;
+            }
+        }
+        return static_cast<float>(bestLabel);
+    }
+}
+
+void
+BinaryFeatures::packRow(const cv::Mat& aRow, uint8_t* aOutput) {
+    CV_Assert(aRow.total() == static_cast<size_t>(FEATURE_BITS) && aRow.isContinuous() && aRow.channels() == 1);
+    CV_Assert(aRow.depth() == CV_8U || aRow.depth() == CV_32F);
+
+    std::memset(aOutput, 0, FEATURE_ROW_STRIDE);
+    if(aRow.depth() == CV_8U) {
+        const uint8_t* values = aRow.ptr<uint8_t>();
+        for(int bit = 0; bit < FEATURE_BITS; ++bit)
+            if(values[bit])
+                aOutput[bit >> 3] |= static_cast<uint8_t>(1u << (bit & 7));
+    } else {
+        const float* values = aRow.ptr<float>();
+        for(int bit = 0; bit < FEATURE_BITS; ++bit)
+            if(values[bit] != 0.0f)
+                aOutput[bit >> 3] |= static_cast<uint8_t>(1u << (bit & 7));
+    }
+}
+
+cv::Mat
+BinaryFeatures::packRows(const cv::Mat& aRows) {
+    cv::Mat packed(aRows.rows, FEATURE_ROW_STRIDE, CV_8U);
+    for(int row = 0; row < aRows.rows; ++row)
+        BinaryFeatures::packRow(aRows.row(row), packed.ptr<uint8_t>(row));
+    return packed;
+}
+
+void
+BinaryFeatures::hammingDistances(const uint8_t* aQuery, const uint8_t* aRows, size_t aCount, uint32_t* aDistances) {
+    pKernel().kernel(aQuery, aRows, aCount, aDistances);
+}
+
+const char*
+BinaryFeatures::kernelName() {
+    return pKernel().name;
+}
+
+// Blocks are allocated as samples are added and never move, so a search can read
+// the first count samples while another sample is being written.
+struct BinaryKNearest::AddedSamples {
+    static constexpr size_t BLOCK_SAMPLES = BLOCK_ROWS;
+
+    struct Block {
+        alignas(64) uint8_t rows[BLOCK_SAMPLES * FEATURE_ROW_STRIDE];
+        int32_t labels[BLOCK_SAMPLES];
+    };
+
+    std::array<std::unique_ptr<Block>, MAX_ADDED_SAMPLES / BLOCK_SAMPLES> blocks;
+
+    // Samples fully written, published after their row and label.
+    std::atomic<size_t> count{0};
+
+    // Serializes writers only.
+    std::mutex mutex;
+};
+
+BinaryKNearest::BinaryKNearest()
+    : mAdded(std::make_unique<AddedSamples>())
+{
+}
+
+BinaryKNearest::~BinaryKNearest() = default;
+
+cv::Ptr<BinaryKNearest>
+BinaryKNearest::create() {
+    return cv::makePtr<BinaryKNearest>();
+}
+
+cv::Ptr<BinaryKNearest>
+BinaryKNearest::load(const std::string& aFilepath) {
+    auto model = BinaryKNearest::create();
+    cv::Mat samples, responses;
+    try {
+        cv::FileStorage storage(aFilepath, cv::FileStorage::READ);
+        if(!storage.isOpened()) {
+            LOG(level::warning, "BinaryKNearest::load()", "Unable to open " + QString::fromStdString(aFilepath));
+            return model;
+        }
+        // Same layout cv::ml::KNearest::save() writes.
+        cv::FileNode modelNode = storage.getFirstTopLevelNode();
+        modelNode["samples"] >> samples;
+        modelNode["responses"] >> responses;
+    } catch(const cv::Exception& ex) {
+        LOG(level::error, "BinaryKNearest::load()", ex.what());
+        return model;
+    }
+
+    if(!model->train(samples, responses))
+        LOG(level::warning, "BinaryKNearest::load()", "Model in " + QString::fromStdString(aFilepath) +
+            " does not hold " + QString::number(FEATURE_BITS) + " feature samples.");
+    else
+        LOG(level::standard, "BinaryKNearest::load()", "Loaded " + QString::number(model->getSampleCount()) +
+            " samples using the " + BinaryFeatures::kernelName() + " kernel.");
+    return model;
+}
+
+bool
+BinaryKNearest::train(const cv::Mat& aSamples, const cv::Mat& aResponses) {
+    if(aSamples.empty() || aSamples.cols != FEATURE_BITS || aResponses.total() != static_cast<size_t>(aSamples.rows))
+        return false;
+
+    cv::Mat labels;
+    aResponses.reshape(1, 1).convertTo(labels, CV_32S);
+
+    return setPackedSamples(BinaryFeatures::packRows(aSamples.isContinuous() ? aSamples : aSamples.clone()), labels);
+}
+
+bool
+BinaryKNearest::setPackedSamples(const cv::Mat& aPackedSamples, const cv::Mat& aResponses,
+                                 std::shared_ptr<const void> aStorage) {
+    if(aPackedSamples.empty() || aPackedSamples.cols != FEATURE_ROW_STRIDE || aPackedSamples.type() != CV_8U
+        || !aPackedSamples.isContinuous() || aResponses.type() != CV_32S || !aResponses.isContinuous()
+        || aResponses.total() != static_cast<size_t>(aPackedSamples.rows))
+        return false;
+
+    mSamples = aPackedSamples;
+    mResponses = aResponses.reshape(1, 1);
+    mStorage = std::move(aStorage);
+    mIndex.reset();
+    mAdded = std::make_unique<AddedSamples>();
+    return true;
+}
+
+bool
+BinaryKNearest::addSample(const uint8_t* aPackedRow, int aLabel) {
+    std::lock_guard<std::mutex> lock(mAdded->mutex);
+    const size_t count = mAdded->count.load(std::memory_order_relaxed);
+    if(count == static_cast<size_t>(MAX_ADDED_SAMPLES))
+        return false;
+
+    // Searches only read blocks below count, a new block is not seen before it is published.
+    auto& block = mAdded->blocks[count / AddedSamples::BLOCK_SAMPLES];
+    if(!block)
+        block = std::make_unique<AddedSamples::Block>();
+    const size_t row = count % AddedSamples::BLOCK_SAMPLES;
+    std::memcpy(block->rows + row * FEATURE_ROW_STRIDE, aPackedRow, FEATURE_ROW_STRIDE);
+    block->labels[row] = aLabel;
+    mAdded->count.store(count + 1, std::memory_order_release);
+    return true;
+}
+
+int
+BinaryKNearest::getAddedSampleCount() const {
+    return static_cast<int>(mAdded->count.load(std::memory_order_acquire));
+}
+
+float
+BinaryKNearest::findNearest(cv::InputArray aSamples, int aK, cv::OutputArray aResults,
+                            cv::OutputArray aNeighborResponses, cv::OutputArray aDistances) const {
+    cv::Mat samples = aSamples.getMat();
+    CV_Assert(!empty() && aK > 0 && samples.cols == FEATURE_BITS);
+
+    const int queryCount = samples.rows;
+    const int sampleCount = getSampleCount();
+    // Samples added from now on are left for the next search.
+    const size_t addedCount = mAdded->count.load(std::memory_order_acquire);
+    const int k = std::min(aK, sampleCount + static_cast<int>(addedCount));
+    cv::Mat queries = BinaryFeatures::packRows(samples.isContinuous() ? samples : samples.clone());
+
+    // The k best neighbours of every query, kept sorted by (distance, sample index).
+    // Added samples are numbered after the reference set.
+    std::vector<std::pair<uint32_t, int>> best(static_cast<size_t>(queryCount) * k, {UINT32_MAX, INT_MAX});
+
+    uint32_t distances[BLOCK_ROWS];
+    // Merge aCount distances of consecutive samples, the first one numbered aFirstSample.
+    auto insertBlock = [&best, &distances, k](int aQuery, int aFirstSample, size_t aCount) {
+        auto* neighbours = &best[static_cast<size_t>(aQuery) * k];
+        for(size_t index = 0; index < aCount; ++index) {
+            // Strict comparison keeps the earlier sample on equal distance.
+            if(distances[index] >= neighbours[k - 1].first)
+                continue;
+            int position = k - 1;
+            while(position > 0 && neighbours[position - 1].first > distances[index]) {
+                neighbours[position] = neighbours[position - 1];
+                --position;
+            }
+            neighbours[position] = {distances[index], aFirstSample + static_cast<int>(index)};
+        }
+    };
+
+    if(mIndex) {
+        std::vector<VPTreeIndex::Neighbour> found;
+        for(int query = 0; query < queryCount; ++query) {
+            mIndex->search(mSamples, queries.ptr<uint8_t>(query), std::min(k, sampleCount), found);
+            std::copy(found.begin(), found.end(), best.begin() + static_cast<size_t>(query) * k);
+        }
+    } else {
+        for(int start = 0; start < sampleCount; start += static_cast<int>(BLOCK_ROWS)) {
+            const size_t count = std::min(BLOCK_ROWS, static_cast<size_t>(sampleCount - start));
+            for(int query = 0; query < queryCount; ++query) {
+                BinaryFeatures::hammingDistances(queries.ptr<uint8_t>(query), mSamples.ptr<uint8_t>(start), count, distances);
+                insertBlock(query, start, count);
+            }
+        }
+    }
+
+    for(size_t start = 0; start < addedCount; start += AddedSamples::BLOCK_SAMPLES) {
+        const AddedSamples::Block& block = *mAdded->blocks[start / AddedSamples::BLOCK_SAMPLES];
+        const size_t count = std::min(AddedSamples::BLOCK_SAMPLES, addedCount - start);
+        for(int query = 0; query < queryCount; ++query) {
+            BinaryFeatures::hammingDistances(queries.ptr<uint8_t>(query), block.rows, count, distances);
+            insertBlock(query, sampleCount + static_cast<int>(start), count);
+        }
+    }
+
+    cv::Mat results(queryCount, 1, CV_32F);
+    cv::Mat neighbourResponses(queryCount, k, CV_32F);
+    cv::Mat neighbourDistances(queryCount, k, CV_32F);
+    std::vector<int> labels(k);
+    for(int query = 0; query < queryCount; ++query) {
+        const auto* neighbours = &best[static_cast<size_t>(query) * k];
+        for(int index = 0; index < k; ++index) {
+            const int sample = neighbours[index].second;
+            if(sample < sampleCount) {
+                labels[index] = mResponses.at<int>(sample);
+            } else {
+                const size_t added = static_cast<size_t>(sample - sampleCount);
+                labels[index] = mAdded->blocks[added / AddedSamples::BLOCK_SAMPLES]->labels[added % AddedSamples::BLOCK_SAMPLES];
+            }
+            neighbourResponses.at<float>(query, index) = static_cast<float>(labels[index]);
+            neighbourDistances.at<float>(query, index) = static_cast<float>(neighbours[index].first);
+        }
+        results.at<float>(query) = pVote(labels);
+    }
+
+    if(aResults.needed())
+        results.copyTo(aResults);
+    if(aNeighborResponses.needed())
+        neighbourResponses.copyTo(aNeighborResponses);
+    if(aDistances.needed())
+        neighbourDistances.copyTo(aDistances);
+
+    return queryCount > 0 ? results.at<float>(0) : 0.0f;
+}
+
+void
+BinaryKNearest::setIndex(const cv::Ptr<VPTreeIndex>& aIndex) {
+    if(aIndex && (aIndex->empty() || aIndex->getSampleCount() != getSampleCount())) {
+        LOG(level::warning, "BinaryKNearest::setIndex()", "Index was built for " +
+            QString::number(aIndex->getSampleCount()) + " samples, model holds " +
+            QString::number(getSampleCount()) + ". Ignoring index.");
+        mIndex.reset();
+        return;
+    }
+    mIndex = aIndex;
+}
+
+cv::Ptr<VPTreeIndex>
+BinaryKNearest::getIndex() const {
+    return mIndex;
+}
+
+const cv::Mat&
+BinaryKNearest::getPackedSamples() const {
+    return mSamples;
+}
+
+const cv::Mat&
+BinaryKNearest::getResponses() const {
+    return mResponses;
+}
+
+bool
+BinaryKNearest::empty() const {
+    return mResponses.empty();
+}
+
+int
+BinaryKNearest::getSampleCount() const {
+    return static_cast<int>(mResponses.total());
+}
@@ -1,13 +1,20 @@
 #include "DrawArea.hpp"
 
+#include <algorithm>
+
 #include <QPainter>
 #include <QMouseEvent>
-#include <QPixmap>
+#include <QPaintEvent>
 #include <QDir>
+#include <QFile>
+#include <QTextStream>
 #include <QVector>
 #include <QRegularExpression>
+#include <QtConcurrent/QtConcurrentRun>
 
 #include "ImageProcessMethods.hpp"
+#include "ModelFile.hpp"
+#include "VPTreeIndex.hpp"
 
 #include "opencv2/imgproc.hpp"
 
@@ -15,46 +22,78 @@
 
 std::string resourcePath = "../resource/";
 
+namespace {
+    // Quiet time after a stroke before live recognition runs. Fast
+    // consecutive strokes only trigger a single request.
+    constexpr int LIVE_RECOGNITION_DELAY_MS = 100;
+
+    // Strokes between two checkpoints of the canvas. Bounds the strokes
+    // rasterized again by an undo.
+    constexpr int CHECKPOINT_INTERVAL = 8;
+
+    // Samples added by learnDrawing(), in the resource folder.
+    const char* SAMPLE_LOG_FILE = "kNN_Samples.log";
+}
+
 DrawArea::DrawArea(QWidget* parent)
     : QLabel(parent),
       mCurrentlyDrawing(false),
-      mHardLayer(this->size(), 0),
-      mVirtualLayer(this->size(), 0),
+      mCanvasImage(this->size(), QImage::Format_RGB32),
+      mFlushedPoints(0),
       mId(1),
       mPenWidth(30),
-      mKnn(cv::ml::KNearest::load(resourcePath + "kNN_ETL_Subset.opknn")),
-      mKnnDictFilepath(resourcePath + "kNNDictionary.txt")
+      mKnnDictFilepath(resourcePath + "kNNDictionary.txt"),
+      mRecognitionExecutor(new RecognitionExecutor(this)),
+      mLoadWatcher(new QFutureWatcher<Resources>(this)),
+      mModelReady(false),
+      mLiveRecognition(false),
+      mLiveTimer(new QTimer(this))
 {
     this->clear();
 
-    mHardLayer.fill(); // set to white.
-    this->setPixmap(mHardLayer);
+    mCanvasImage.fill(Qt::white); // set to white.
 
     mVirtualLayerVector.reserve(32);
 
-    pResourceCharacterImages();
+    QObject::connect(mRecognitionExecutor, &RecognitionExecutor::recognized,
+                     this, &DrawArea::pRecognized);
+
+    mLiveTimer->setSingleShot(true);
+    mLiveTimer->setInterval(LIVE_RECOGNITION_DELAY_MS);
+    QObject::connect(mLiveTimer, &QTimer::timeout, this, &DrawArea::compareLayer);
+
+    // Loading the model and decoding the resource images would delay the first paint,
+    // so it happens on a worker thread. The user can draw in the meantime.
+    QObject::connect(mLoadWatcher, &QFutureWatcher<Resources>::finished,
+                     this, &DrawArea::pResourcesLoaded);
+    mLoadWatcher->setFuture(QtConcurrent::run(&DrawArea::pLoadResources, mKnnDictFilepath));
 }
 
 void
 DrawArea::mousePressEvent(QMouseEvent* event) {
 //    qDebug() << "Mouse press: " << event->pos() << "\n";
-    //mVirtualLayer = DrawLayer(this->size(), mId++);
-    mVirtualLayer.setId(mId++);
-    mVirtualLayer.fill(Qt::transparent);
-    updateDrawArea();
+    // Start a new stroke, drawn with the current pen width.
+    // The canvas already holds every finished stroke.
+    mVirtualLayer = DrawLayer(mId++, mPenWidth);
+    mFlushedPoints = 0;
     // Indicate that we are beginning to draw.
     mCurrentlyDrawing = true;
     // Draw the starting point.
     mPrevPoint = event->pos();
-    pDrawPoint(event->pos());
+    pDrawPoint(event->pos(), event->timestamp());
+    emit drawingChanged();
 }
 
 void
 DrawArea::mouseReleaseEvent(QMouseEvent* event) {
 //    qDebug() << "Mouse release: " << event->pos() << "\n";
+    // Rasterize the points not drawn by a frame yet.
+    pFlushStroke();
     // Add the finished layer to layer vector
     mVirtualLayer.setEnableStatus(true);
     mVirtualLayerVector.append(mVirtualLayer);
+    mRedoLayerVector.clear();
+    pCheckpoint();
     // Call update handle to let other objects or owner
     // know of the changes.
     layerUpdateHandle();
@@ -62,43 +101,65 @@ DrawArea::mouseReleaseEvent(QMouseEvent* event) {
     mCurrentlyDrawing = false;
     // Indicate that the mPrevPoint is invalid.
     mPrevPoint = QPoint(-1,-1);
+
+    if(mLiveRecognition && mModelReady)
+        mLiveTimer->start();
 }
 
 void
 DrawArea::mouseMoveEvent(QMouseEvent *event) {
     if(mCurrentlyDrawing)
-        pDrawPoint(event->pos());
+        pDrawPoint(event->pos(), event->timestamp());
 }
 
 void
 DrawArea::resizeDrawArea(QSize aSize) {
-    // First clear out current label and resize
-    this->clear();
     resize(aSize);
-    // Be careful, We are not really copying any pixel data
-    // from the original pixmap(s), we are just resizing.
-    mHardLayer = DrawLayer(aSize, mHardLayer.getId());
-    mVirtualLayer = DrawLayer(aSize, mVirtualLayer.getId());
-    // Set the pixmap in this object (recall we are a QLabel).
-    this->setPixmap(mHardLayer);
+    // Strokes are stored as points, they are simply
+    // rasterized again at the new size.
+    mCanvasImage = QImage(aSize, QImage::Format_RGB32);
+    updateGeometry();
+    updateDrawArea();
 }
 
 void
 DrawArea::updateDrawArea() {
-    this->clear();
-    //mHardLayer = DrawLayer(this->size(), mVirtualLayer.getId());
-    mHardLayer.fill();
-    QPainter painter = QPainter(&mHardLayer);
-    for(const auto& layers: mVirtualLayerVector)
-        if(layers.isEnabled())
-            painter.drawPixmap(0,0, layers);
-    this->setPixmap(mHardLayer);
-    painter.end();
+    // Rasterize every stroke again, the checkpoints are rebuilt along the way.
+    mCanvasImage.fill(Qt::white);
+    mInkBounds = QRect();
+    mCheckpoints.clear();
+    for(int index = 0; index < mVirtualLayerVector.size(); ++index) {
+        if(mVirtualLayerVector[index].isEnabled())
+            pPaintLayer(mVirtualLayerVector[index]);
+        if((index + 1) % CHECKPOINT_INTERVAL == 0)
+            mCheckpoints.append(Checkpoint{mCanvasImage, mInkBounds});
+    }
+    update();
+}
+
+QSize
+DrawArea::sizeHint() const {
+    return mCanvasImage.size();
+}
+
+QSize
+DrawArea::minimumSizeHint() const {
+    return mCanvasImage.size();
+}
+
+void
+DrawArea::paintEvent(QPaintEvent* event) {
+    // Points received since the last frame are drawn as one batch.
+    pFlushStroke();
+    // Only the invalidated area is copied to the screen.
+    QPainter painter(this);
+    painter.drawImage(event->rect(), mCanvasImage, event->rect());
 }
 
 QImage
 DrawArea::generateImage() {
-    return mHardLayer.toImage();
+    pFlushStroke();
+    return mCanvasImage;
 }
 
 void
@@ -109,16 +170,85 @@ DrawArea::setPenWidth(int width) {
         LOG(level::warning, "DrawArea::setPenWidth()","Tried to set pen width < 1.");
 }
 
-int
+void
 DrawArea::compareLayer() {
-    // we will get the entire draw area.
-    cv::Mat hardLayerMat = ImageMethods::qImageToCvMat(generateImage().copy(0,0, 384, 384));
-    // for our image we do need to invert the colors from white-bg black-fg to white-fg black-bg
-    cv::bitwise_not(hardLayerMat, hardLayerMat);
+    if(!mModelReady) {
+        LOG(level::warning, "DrawArea::compareLayer()", "kNN model is not loaded yet.");
+        return;
+    }
+
+    // Only the snapshot is taken on the GUI thread, the rest of the pipeline
+    // runs on the executor's workers. The snapshot shares the canvas raster.
+    // Drawings recognized before are answered from the executor's cache.
+    mRecognitionExecutor->submit(generateImage(), mInkBounds, pFingerprint());
+}
+
+void
+DrawArea::learnDrawing(int aLabel, quint64 aFingerprint) {
+    if(!mModelReady || mBinaryKnn->empty() || !mSampleLog) {
+        LOG(level::warning, "DrawArea::learnDrawing()", "Samples can only be added to the bit packed kNN model.");
+        return;
+    }
+    if(aFingerprint != pFingerprint()) {
+        LOG(level::warning, "DrawArea::learnDrawing()", "The drawing changed since it was recognized.");
+        return;
+    }
 
-    //return TechniqueMethods::ROITranslocation(mKnn, hardLayerMat, true);
-    auto scaledImages = TechniqueMethods::ROIRescaling(hardLayerMat, true);
-    return ImageMethods::passThroughKNNModel(mKnn, scaledImages);
+    // Same feature as the 1.0 scale of a recognition.
+    cv::Mat canvas;
+    ImageMethods::qImageToInvertedGray(generateImage(), canvas);
+    cv::Rect roi = mInkBounds.isNull()
+        ? ImageMethods::obtainROI(canvas)
+        : ImageMethods::obtainROI(canvas, cv::Rect(mInkBounds.x(), mInkBounds.y(),
+                                                   mInkBounds.width(), mInkBounds.height()));
+    if(roi.empty()) {
+        LOG(level::warning, "DrawArea::learnDrawing()", "Nothing drawn.");
+        return;
+    }
+    ImageMethods::FeatureWorkspace workspace;
+    cv::Mat features = ImageMethods::rescaleROIToFeatures({1.0f}, canvas, roi, workspace);
+    if(features.empty())
+        return;
+
+    uint8_t packed[FEATURE_ROW_STRIDE];
+    BinaryFeatures::packRow(features.row(0), packed);
+    if(!mBinaryKnn->addSample(packed, aLabel)) {
+        LOG(level::warning, "DrawArea::learnDrawing()", "Too many samples added, restart to merge them into the model.");
+        return;
+    }
+    if(!mSampleLog->append(packed, aLabel))
+        LOG(level::error, "DrawArea::learnDrawing()", "Unable to write the sample log, the sample is lost on exit.");
+    LOG(level::standard, "DrawArea::learnDrawing()", "Added the drawing as label " + QString::number(aLabel));
+
+    // Cached results predate the sample.
+    mRecognitionExecutor->clearCaches();
+    compareLayer();
+}
+
+quint64
+DrawArea::pFingerprint() const {
+    RecognitionCache::Fingerprint fingerprint;
+    fingerprint.add(mCanvasImage.width());
+    fingerprint.add(mCanvasImage.height());
+
+    auto addLayer = [&fingerprint](const DrawLayer& aLayer) {
+        if(!aLayer.isEnabled())
+            return;
+        const QVector<QPoint>& points = aLayer.getPoints();
+        fingerprint.add(aLayer.getWidth());
+        fingerprint.add(points.size());
+        for(const QPoint& point : points) {
+            fingerprint.add(point.x());
+            fingerprint.add(point.y());
+        }
+    };
+    for(const DrawLayer& layer : mVirtualLayerVector)
+        addLayer(layer);
+    if(mCurrentlyDrawing)
+        addLayer(mVirtualLayer);
+
+    // 0 disables the cache.
+    return fingerprint.value() != 0 ? fingerprint.value() : 1;
 }
 
 QImage 
@@ -126,38 +256,206 @@ DrawArea::getResourceCharacterImage(int index) {
     return mComparisonImagesDict[index];
 }
 
+bool
+DrawArea::isModelReady() const {
+    return mModelReady;
+}
+
+QRect
+DrawArea::getInkBounds() const {
+    return mInkBounds;
+}
+
+const RecognitionCache&
+DrawArea::getRecognitionCache() const {
+    return mRecognitionExecutor->getResultCache();
+}
+
+void
+DrawArea::pResourcesLoaded() {
+    Resources resources = mLoadWatcher->result();
+    mKnn = resources.knn;
+    mBinaryKnn = resources.binaryKnn;
+    mComparisonImagesDict = resources.comparisonImages;
+    mSampleLog = resources.sampleLog;
+    mRecognitionExecutor->setModels(mBinaryKnn, mKnn);
+
+    mModelReady = !mBinaryKnn->empty() || (mKnn && mKnn->isTrained());
+    if(!mModelReady)
+        LOG(level::error, "DrawArea::pResourcesLoaded()", "No kNN model could be loaded.");
+    emit modelReady(mModelReady);
+}
+
+void
+DrawArea::pRecognized(const RecognitionResult& aResult) {
+    LOG(level::info, "DrawArea::pRecognized()", "Label " + QString::number(aResult.label) + " with confidence "
+        + QString::number(aResult.confidence) + " after " + QString::number(aResult.distances.size()) + " scales.");
+    emit layerCompared(aResult.label);
+    emit layerRecognized(aResult);
+}
+
 void
 DrawArea::undoLayer() {
     uint vectorSize = mVirtualLayerVector.size();
     if (vectorSize) {
-        mVirtualLayerVector.remove(vectorSize - 1);
-        updateDrawArea();
+        mRedoLayerVector.append(mVirtualLayerVector.takeLast());
+        pRestoreComposite();
+        emit drawingChanged();
+        if(mLiveRecognition && mModelReady)
+            mLiveTimer->start();
     }
 }
 
 void
-DrawArea::pDrawPoint(QPoint aPoint) {
-    auto painter_hard = QPainter(&mHardLayer);
-    auto painter_virt = QPainter(&mVirtualLayer);
-    QPen pen = QPen(Qt::black, mPenWidth, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
-    painter_hard.setPen(pen);
-    painter_virt.setPen(pen);
+DrawArea::redoLayer() {
+    if(mRedoLayerVector.isEmpty())
+        return;
+
+    mVirtualLayerVector.append(mRedoLayerVector.takeLast());
+    if(mVirtualLayerVector.last().isEnabled())
+        pPaintLayer(mVirtualLayerVector.last());
+    pCheckpoint();
+    emit drawingChanged();
+    if(mLiveRecognition && mModelReady)
+        mLiveTimer->start();
+}
 
-    painter_hard.drawLine(mPrevPoint, aPoint);
-    painter_virt.drawLine(mPrevPoint, aPoint);
+void
+DrawArea::setLiveRecognition(bool aEnabled) {
+    mLiveRecognition = aEnabled;
+    if(!mLiveRecognition)
+        mLiveTimer->stop();
+    else if(mModelReady)
+        mLiveTimer->start();
+}
+
+void
+DrawArea::pPaintLayer(const DrawLayer& aLayer) {
+    auto painter = QPainter(&mCanvasImage);
+    aLayer.paint(painter);
+    painter.end();
+    mInkBounds |= aLayer.getInkBounds();
+    update(aLayer.getInkBounds());
+}
+
+void
+DrawArea::pCheckpoint() {
+    // The copy is shared with the canvas, its pixels are only duplicated
+    // once the canvas is drawn on.
+    if(mVirtualLayerVector.size() % CHECKPOINT_INTERVAL == 0
+        && mCheckpoints.size() < mVirtualLayerVector.size() / CHECKPOINT_INTERVAL)
+        mCheckpoints.append(Checkpoint{mCanvasImage, mInkBounds});
+}
+
+void
+DrawArea::pRestoreComposite() {
+    const int checkpoint = mVirtualLayerVector.size() / CHECKPOINT_INTERVAL;
+    mCheckpoints.resize(std::min(checkpoint, mCheckpoints.size()));
+
+    int firstLayer = 0;
+    if(mCheckpoints.isEmpty()) {
+        mCanvasImage.fill(Qt::white);
+        mInkBounds = QRect();
+    } else {
+        mCanvasImage = mCheckpoints.last().composite;
+        mInkBounds = mCheckpoints.last().inkBounds;
+        firstLayer = mCheckpoints.size() * CHECKPOINT_INTERVAL;
+    }
+
+    for(int index = firstLayer; index < mVirtualLayerVector.size(); ++index)
+        if(mVirtualLayerVector[index].isEnabled())
+            pPaintLayer(mVirtualLayerVector[index]);
+    // A stroke being drawn is rasterized again by the next frame.
+    mFlushedPoints = 0;
+    update();
+}
+
+void
+DrawArea::pDrawPoint(QPoint aPoint, qint64 aTimestamp) {
+    // Every sample is kept, but nothing is rasterized until the next frame.
+    mVirtualLayer.addPoint(aPoint, aTimestamp);
+    mInkBounds |= mVirtualLayer.getInkBounds();
+
+    // Only repaint the area touched by the segment.
+    const int margin = static_cast<int>(mVirtualLayer.getWidth());
+    update(QRect(mPrevPoint, aPoint).normalized().adjusted(-margin, -margin, margin, margin));
 
     mPrevPoint = aPoint;
-    painter_hard.end();
-    painter_virt.end();
-    this->setPixmap(mHardLayer);
 }
 
 void
-DrawArea::pResourceCharacterImages() {
-    QFile knnDictFile = QFile(mKnnDictFilepath.c_str());
-    if(!knnDictFile.open(QIODevice::ReadOnly | QIODevice::Text))
+DrawArea::pFlushStroke() {
+    if(!mCurrentlyDrawing || mFlushedPoints >= mVirtualLayer.getPoints().size())
         return;
 
+    // The stroke is only rasterized into the canvas, which is also what is shown.
+    auto painter = QPainter(&mCanvasImage);
+    mVirtualLayer.paint(painter, mFlushedPoints);
+    painter.end();
+    mFlushedPoints = mVirtualLayer.getPoints().size();
+}
+
+DrawArea::Resources
+DrawArea::pLoadResources(const std::string& aKnnDictFilepath) {
+    Resources resources;
+    const std::string modelFilepath = resourcePath + "kNN_ETL_Subset.jpknn";
+    const std::string indexFilepath = resourcePath + "kNN_ETL_Subset.vpt";
+    const std::string sampleLogFilepath = resourcePath + SAMPLE_LOG_FILE;
+
+    // Samples added during earlier sessions become part of the model file.
+    const bool merged = ModelFile::mergeSampleLog(modelFilepath, sampleLogFilepath) > 0;
+
+    // Prefer the memory mapped model, it is used in place. Without it, pack the samples
+    // of the OpenCV model, and fall back on the OpenCV model if that fails too.
+    resources.binaryKnn = ModelFile::load(modelFilepath);
+    if(resources.binaryKnn->empty()) {
+        LOG(level::warning, "DrawArea::pLoadResources()", "kNN_ETL_Subset.jpknn not found, parsing the OpenCV model. "
+            "Run CONVERT_MODEL to speed up startup.");
+        resources.binaryKnn = BinaryKNearest::load(resourcePath + "kNN_ETL_Subset.opknn");
+    }
+    if(resources.binaryKnn->empty()) {
+        try {
+            resources.knn = cv::ml::KNearest::load(resourcePath + "kNN_ETL_Subset.opknn");
+        } catch(const cv::Exception& ex) {
+            LOG(level::error, "DrawArea::pLoadResources()", ex.what());
+        }
+    } else {
+        // Index built offline by BUILD_INDEX. Without it every query scans the whole model.
+        auto index = VPTreeIndex::load(indexFilepath);
+        // The merged samples are missing from the index.
+        if(merged && !index->empty()) {
+            const int searchBudget = index->getSearchBudget();
+            index = VPTreeIndex::build(resources.binaryKnn->getPackedSamples());
+            index->setSearchBudget(searchBudget);
+            if(!index->save(indexFilepath))
+                LOG(level::warning, "DrawArea::pLoadResources()", "Unable to update " + QString::fromStdString(indexFilepath));
+        }
+        if(!index->empty())
+            resources.binaryKnn->setIndex(index);
+
+        // A log that could not be merged, e.g. with the OpenCV model, is still searched.
+        // A merged log is part of the model already.
+        cv::Mat logSamples;
+        std::vector<int> logLabels;
+        if(!merged && SampleLog::read(sampleLogFilepath, logSamples, logLabels)) {
+            for(int row = 0; row < logSamples.rows; ++row)
+                resources.binaryKnn->addSample(logSamples.ptr<uint8_t>(row), logLabels[row]);
+        }
+        resources.sampleLog = std::make_shared<SampleLog>(sampleLogFilepath);
+    }
+
+    resources.comparisonImages = pResourceCharacterImages(aKnnDictFilepath);
+    return resources;
+}
+
+QMap<int, QImage>
+DrawArea::pResourceCharacterImages(const std::string& aKnnDictFilepath) {
+    QMap<int, QImage> comparisonImagesDict;
+
+    QFile knnDictFile = QFile(aKnnDictFilepath.c_str());
+    if(!knnDictFile.open(QIODevice::ReadOnly | QIODevice::Text))
+        return comparisonImagesDict;
+
     QDir resourceDir = QDir(QString(resourcePath.c_str()));
     QStringList images = resourceDir.entryList(QStringList() << "*.png" << "*.PNG", QDir::Files);
 
@@ -174,11 +472,13 @@ DrawArea::pResourceCharacterImages() {
                 LOG(level::standard, "DrawArea::pResourceCharacterImages()",
                     QString(match_png.captured("character") + " " + match_txt.captured("number")));
 
-                mComparisonImagesDict.insert(match_txt.captured("number").toInt(),
-                                             QImage(resourceDir.filePath(png)));
+                comparisonImagesDict.insert(match_txt.captured("number").toInt(),
+                                            QImage(resourceDir.filePath(png)));
                 images.removeOne(png);
                 break;
             }
         }
     }
-}
\ No newline at end of file
+
+    return comparisonImagesDict;
+}
@@ -1,8 +1,9 @@
 #include "DrawLayer.hpp"
 
-DrawLayer::DrawLayer(QSize aSize, uint aId)
-    : QPixmap(aSize),
-    mId(aId), mEnabled(false)
+#include <QPainter>
+
+DrawLayer::DrawLayer(uint aId, uint aWidth)
+    : mId(aId), mEnabled(false), mWidth(aWidth)
 {}
 
 void
@@ -23,3 +24,41 @@ DrawLayer::isEnabled() const { return mEnabled; }
 void
 DrawLayer::setEnableStatus(bool status) { mEnabled = status; }
 
+uint
+DrawLayer::getWidth() const { return mWidth; }
+
+QPen
+DrawLayer::getPen() const {
+    return QPen(Qt::black, mWidth, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
+}
+
+void
+DrawLayer::addPoint(const QPoint& aPoint, qint64 aTimestamp) {
+    mPoints.append(aPoint);
+    mTimestamps.append(aTimestamp);
+    // Round caps reach half the pen width past every point.
+    const int margin = static_cast<int>(mWidth) / 2 + 1;
+    mInkBounds |= QRect(aPoint, aPoint).adjusted(-margin, -margin, margin, margin);
+}
+
+const QVector<QPoint>&
+DrawLayer::getPoints() const { return mPoints; }
+
+const QVector<qint64>&
+DrawLayer::getTimestamps() const { return mTimestamps; }
+
+QRect
+DrawLayer::getInkBounds() const { return mInkBounds; }
+
+void
+DrawLayer::paint(QPainter& aPainter, int aFirstPoint) const {
+    if(aFirstPoint >= mPoints.size())
+        return;
+    // Start at the previous point so the new part is joined to what was already drawn.
+    const int first = aFirstPoint > 0 ? aFirstPoint - 1 : 0;
+    aPainter.setPen(getPen());
+    if(mPoints.size() - first == 1)
+        aPainter.drawPoint(mPoints[first]);
+    else
+        aPainter.drawPolyline(mPoints.constData() + first, mPoints.size() - first);
+}
@@ -2,11 +2,49 @@
 #include <QString>
 #include <QDebug>
 #include <QImage>
+#include <algorithm>
+#include <cmath>
 
 #include "opencv2/imgcodecs.hpp"
 #include "opencv2/imgproc.hpp"
+#include "BinaryKNN.hpp"
 #include "Log.hpp"
 
+namespace {
+    // Current selected scalar values are not based on any empirical data.
+    // just what feels right.
+    const std::vector<float> ROI_RESCALING_SCALARS = {.70f, .75f, .80f, .85f, .90f, .95f, 1.0f, 1.05f, 1.10f};
+
+    // Shared by the cv::ml::KNearest and BinaryKNearest overloads, both expose
+    // the same findNearest() interface.
+    template<typename Model>
+    std::vector<int>
+    pPassThroughModelBatch(const cv::Ptr<Model>& aKNNModel, const std::vector<cv::Mat>& aProcessedImages,
+                           cv::Mat* aDistances) {
+        auto calculatedLabels = std::vector<int>();
+        if(aProcessedImages.empty())
+            return calculatedLabels;
+
+        cv::Mat input = ImageMethods::prepareBatchForKNN(aProcessedImages);
+        cv::Mat output, neighbours, distances;
+        try {
+            aKNNModel->findNearest(input, KNN_NEIGHBOURS, output, neighbours, distances);
+        } catch(const cv::Exception& ex) {
+            LOG(level::error, "ImageMethods::passThroughKNNModelBatch()", ex.what());
+            return calculatedLabels;
+        }
+
+        calculatedLabels.reserve(output.rows);
+        for(int row = 0; row < output.rows; ++row)
+            calculatedLabels.push_back(static_cast<int>(output.at<float>(row)));
+
+        if(aDistances)
+            *aDistances = distances;
+
+        return calculatedLabels;
+    }
+}
+
 cv::Mat
 ImageMethods::qImageToCvMat(QImage aImage) {
 	cv::Mat unaltered_mat, grey_mat;
@@ -15,6 +53,40 @@ ImageMethods::qImageToCvMat(QImage aImage) {
 	return grey_mat.clone();
 }
 
+void
+ImageMethods::qImageToInvertedGray(const QImage& aImage, cv::Mat& aOutput) {
+    if(aImage.format() != QImage::Format_RGB32 && aImage.format() != QImage::Format_ARGB32
+        && aImage.format() != QImage::Format_ARGB32_Premultiplied) {
+        ImageMethods::qImageToInvertedGray(aImage.convertToFormat(QImage::Format_RGB32), aOutput);
+        return;
+    }
+
+    aOutput.create(aImage.height(), aImage.width(), CV_8U);
+    // Fixed point weights of cv::COLOR_BGRA2GRAY, so the result matches qImageToCvMat().
+    constexpr int B_WEIGHT = 3735, G_WEIGHT = 19235, R_WEIGHT = 9798, SHIFT = 15;
+    for(int y = 0; y < aImage.height(); ++y) {
+        // Pixels are stored as B, G, R, A bytes.
+        const uchar* source = aImage.constScanLine(y);
+        uchar* destination = aOutput.ptr<uchar>(y);
+        for(int x = 0; x < aImage.width(); ++x, source += 4) {
+            int gray = (source[0] * B_WEIGHT + source[1] * G_WEIGHT + source[2] * R_WEIGHT
+                        + (1 << (SHIFT - 1))) >> SHIFT;
+            destination[x] = static_cast<uchar>(255 - gray);
+        }
+    }
+}
+
+void
+ImageMethods::binarizeCharacter(cv::Mat& aImage) {
+    cv::threshold(aImage, aImage, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+    // The background is whatever covers most of the border.
+    cv::Mat border = aImage.clone();
+    border(cv::Rect(1, 1, std::max(0, aImage.cols - 2), std::max(0, aImage.rows - 2))) = 0;
+    const int borderPixels = 2 * (aImage.cols + aImage.rows) - 4;
+    if(cv::countNonZero(border) * 2 > borderPixels)
+        cv::bitwise_not(aImage, aImage);
+}
+
 int
 ImageMethods::passThroughKNNModel(const cv::Ptr<cv::ml::KNearest> &aKNNModel, const cv::Mat &aProcessedImage) {
     auto flatImage = ImageMethods::prepareMatrixForKNN(aProcessedImage);
@@ -34,50 +106,77 @@ ImageMethods::passThroughKNNModel(const cv::Ptr<cv::ml::KNearest> &aKNNModel, co
 int
 ImageMethods::passThroughKNNModel(const cv::Ptr<cv::ml::KNearest>& aKNNModel,
                                   const std::vector<cv::Mat>& aProcessedImages) {
-    auto calculatedLabels = std::vector<int>();
-    calculatedLabels.reserve(aProcessedImages.size());
-    for(auto& mats : aProcessedImages) {
-        auto flatImage = ImageMethods::prepareMatrixForKNN(mats);
-        cv::Mat input, output;
-        input.push_back(flatImage);
-        input.convertTo(input, CV_32F);
-        output.convertTo(output, CV_32F);
-        try {
-            aKNNModel->findNearest(input, 4, output);
-        } catch(const cv::Exception& ex) {
-            ex.what();
-            return 0;
-        }
-        calculatedLabels.push_back((int)output.at<float>(0));
-    }
+    auto calculatedLabels = ImageMethods::passThroughKNNModelBatch(aKNNModel, aProcessedImages);
+    return ImageMethods::findMostFrequentLabel(calculatedLabels);
+}
+
+std::vector<int>
+ImageMethods::passThroughKNNModelBatch(const cv::Ptr<cv::ml::KNearest>& aKNNModel,
+                                       const std::vector<cv::Mat>& aProcessedImages,
+                                       cv::Mat* aDistances) {
+    return pPassThroughModelBatch(aKNNModel, aProcessedImages, aDistances);
+}
 
+int
+ImageMethods::passThroughKNNModel(const cv::Ptr<BinaryKNearest>& aKNNModel, const cv::Mat& aProcessedImage) {
+    auto calculatedLabels = ImageMethods::passThroughKNNModelBatch(aKNNModel, std::vector<cv::Mat>{aProcessedImage});
+    return calculatedLabels.empty() ? 0 : calculatedLabels.front();
+}
+
+int
+ImageMethods::passThroughKNNModel(const cv::Ptr<BinaryKNearest>& aKNNModel,
+                                  const std::vector<cv::Mat>& aProcessedImages) {
+    auto calculatedLabels = ImageMethods::passThroughKNNModelBatch(aKNNModel, aProcessedImages);
     return ImageMethods::findMostFrequentLabel(calculatedLabels);
 }
 
+std::vector<int>
+ImageMethods::passThroughKNNModelBatch(const cv::Ptr<BinaryKNearest>& aKNNModel,
+                                       const std::vector<cv::Mat>& aProcessedImages,
+                                       cv::Mat* aDistances) {
+    return pPassThroughModelBatch(aKNNModel, aProcessedImages, aDistances);
+}
+
 cv::Rect
 ImageMethods::obtainROI(cv::Mat aMat) {
-    int max_x = -1, max_y = -1;
-    int min_x = INT32_MAX, min_y = INT32_MAX;
-
-    for(int x = 0; x < aMat.rows; ++x) { // width
-        for(int y = 0; y < aMat.cols; ++y) { // cols
-            if(aMat.at<uchar>(x, y) == 255) {
-                if (max_x < x)
-                    max_x = x;
-                if (max_y < y)
-                    max_y = y;
-                if (min_x > x)
-                    min_x = x;
-                if (min_y > y)
-                    min_y = y;
-            }
+    return ImageMethods::obtainROI(aMat, cv::Rect(0, 0, aMat.cols, aMat.rows));
+}
+
+cv::Rect
+ImageMethods::obtainROI(const cv::Mat& aMat, const cv::Rect& aSearchArea) {
+    const cv::Rect area = aSearchArea & cv::Rect(0, 0, aMat.cols, aMat.rows);
+    if(area.empty())
+        return cv::Rect(0, 0, -1, -1);
+
+    // Reduce the ink mask to its column and row maxima, both reductions are
+    // vectorized by OpenCV, then look for the first and last inked entry.
+    cv::Mat ink, inkColumns, inkRows;
+    cv::compare(aMat(area), 255, ink, cv::CMP_EQ);
+    cv::reduce(ink, inkColumns, 0, cv::REDUCE_MAX);
+    cv::reduce(ink, inkRows, 1, cv::REDUCE_MAX);
+
+    int min_x = -1, max_x = -1;
+    for(int x = 0; x < inkColumns.cols; ++x) {
+        if(inkColumns.at<uchar>(0, x)) {
+            if(min_x < 0)
+                min_x = x;
+            max_x = x;
+        }
+    }
+    // Nothing drawn.
+    if(min_x < 0)
+        return cv::Rect(0, 0, -1, -1);
+
+    int min_y = -1, max_y = -1;
+    for(int y = 0; y < inkRows.rows; ++y) {
+        if(inkRows.at<uchar>(y, 0)) {
+            if(min_y < 0)
+                min_y = y;
+            max_y = y;
         }
     }
 
-//    qInfo() << "Dimensions (x_min, y_min): " << min_x << " " << min_y;
-//    qInfo() << "Dimensions (x_max, y_max): " << max_x << " " << max_y;
-
-    return cv::Rect(min_y, min_x, max_y-min_y, max_x-min_x);
+    return cv::Rect(area.x + min_x, area.y + min_y, max_x - min_x, max_y - min_y);
 }
 
 cv::Mat
@@ -91,6 +190,14 @@ ImageMethods::prepareMatrixForKNN(cv::Mat aMat) {
     return aMat.reshape(0, 1);
 }
 
+cv::Mat
+ImageMethods::prepareBatchForKNN(const std::vector<cv::Mat>& aMats) {
+    cv::Mat batch(static_cast<int>(aMats.size()), IMAGE_DIMENSION * IMAGE_DIMENSION, CV_32F);
+    for(size_t index = 0; index < aMats.size(); ++index)
+        ImageMethods::prepareMatrixForKNN(aMats[index]).copyTo(batch.row(static_cast<int>(index)));
+    return batch;
+}
+
 cv::Mat
 ImageMethods::translocateROI(const cv::Mat& aROI, int aHeight, int aWidth) {
 
@@ -138,6 +245,45 @@ ImageMethods::rescaleROI(const std::vector<float>& aTargetScalars, const cv::Mat
     return scaledROIMats;
 }
 
+cv::Mat
+ImageMethods::rescaleROIToFeatures(const std::vector<float>& aTargetScalars, const cv::Mat& aBaseImage,
+                                   const cv::Rect& aROI, FeatureWorkspace& aWorkspace) {
+    // Fewer scalars than rows only use the first rows, the buffer is never shrunk.
+    const int scaleCount = static_cast<int>(aTargetScalars.size());
+    if(aWorkspace.features.rows < scaleCount)
+        aWorkspace.features.create(scaleCount, IMAGE_DIMENSION * IMAGE_DIMENSION, CV_32F);
+    // A no-op once the workspace has the right size.
+    aWorkspace.sample.create(IMAGE_DIMENSION, IMAGE_DIMENSION, CV_8U);
+
+    const cv::Mat roi = aBaseImage(aROI);
+    const double stepX = static_cast<double>(aBaseImage.cols) / IMAGE_DIMENSION;
+    const double stepY = static_cast<double>(aBaseImage.rows) / IMAGE_DIMENSION;
+
+    int count = 0;
+    for(const auto& scalar : aTargetScalars) {
+        // Same rejection and placement as rescaleROI() and translocateROI().
+        if (scalar * roi.rows >= aBaseImage.rows || scalar * roi.cols >= aBaseImage.cols)
+            continue;
+        const int scaledWidth = cvRound(roi.cols * static_cast<double>(scalar));
+        const int scaledHeight = cvRound(roi.rows * static_cast<double>(scalar));
+        const int positionX = aBaseImage.cols / 2 - scaledWidth / 2;
+        const int positionY = aBaseImage.rows / 2 - scaledHeight / 2;
+
+        // Maps the center of every feature pixel to the base image like the downsample in
+        // prepareMatrixForKNN() does, then back through the placement and the rescale to the ROI.
+        const cv::Matx23d featureToROI(stepX / scalar, 0.0, (0.5 * stepX - positionX) / scalar - 0.5,
+                                       0.0, stepY / scalar, (0.5 * stepY - positionY) / scalar - 0.5);
+        cv::warpAffine(roi, aWorkspace.sample, featureToROI, aWorkspace.sample.size(),
+                       cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_CONSTANT, cv::Scalar(0));
+        cv::threshold(aWorkspace.sample, aWorkspace.sample, 15, 255, cv::THRESH_BINARY);
+
+        cv::Mat featureRow = aWorkspace.features.row(count++);
+        aWorkspace.sample.reshape(0, 1).convertTo(featureRow, CV_32F);
+    }
+
+    return aWorkspace.features.rowRange(0, count);
+}
+
 int
 ImageMethods::findMostFrequentLabel(const std::vector<int>& aLabels) {
     std::map<int, int> labelCounter;
@@ -172,7 +318,12 @@ TechniqueMethods::ROITranslocation(const cv::Mat& aBaseImage, bool debugFlag) {
     if(debugFlag) cv::imwrite("RAW_IMAGE.png", aBaseImage);
 
     cv::Rect roi = ImageMethods::obtainROI(aBaseImage);
-    cv::Mat translocatedImage = ImageMethods::translocateROI(aBaseImage(roi).clone(),
+    return TechniqueMethods::ROITranslocation(aBaseImage, roi, debugFlag);
+}
+
+cv::Mat
+TechniqueMethods::ROITranslocation(const cv::Mat& aBaseImage, const cv::Rect& aROI, bool) {
+    cv::Mat translocatedImage = ImageMethods::translocateROI(aBaseImage(aROI).clone(),
                                                              aBaseImage.cols, aBaseImage.rows);
 
     return translocatedImage;
@@ -184,11 +335,14 @@ TechniqueMethods::ROIRescaling(const cv::Mat& aBaseImage, bool debugFlag) {
     if(debugFlag) cv::imwrite("RAW_IMAGE.png", aBaseImage);
 
     cv::Rect roi = ImageMethods::obtainROI(aBaseImage);
+    return TechniqueMethods::ROIRescaling(aBaseImage, roi, debugFlag);
+}
 
-    // Current selected scalar values are not based on any empirical data.
-    // just what feels right.
-    auto rescaledMats = ImageMethods::rescaleROI({.70, .75, .80, .85, .90, .95, 1.0, 1.05, 1.10},
-                                                 aBaseImage(roi).clone(),
+std::vector<cv::Mat>
+TechniqueMethods::ROIRescaling(const cv::Mat& aBaseImage, const cv::Rect& aROI, bool debugFlag) {
+
+    auto rescaledMats = ImageMethods::rescaleROI(ROI_RESCALING_SCALARS,
+                                                 aBaseImage(aROI).clone(),
                                                  aBaseImage.rows, aBaseImage.cols, debugFlag);
 
     if(rescaledMats.empty())
@@ -196,3 +350,24 @@ TechniqueMethods::ROIRescaling(const cv::Mat& aBaseImage, bool debugFlag) {
     return rescaledMats;
 }
 
+cv::Mat
+TechniqueMethods::ROIRescalingFeatures(const cv::Mat& aBaseImage, const cv::Rect& aROI,
+                                       ImageMethods::FeatureWorkspace& aWorkspace) {
+    return ImageMethods::rescaleROIToFeatures(ROI_RESCALING_SCALARS, aBaseImage, aROI, aWorkspace);
+}
+
+const std::vector<float>&
+TechniqueMethods::ROIRescalingScalarsByDistance() {
+    static const std::vector<float> scalars = []() {
+        std::vector<float> ordered = ROI_RESCALING_SCALARS;
+        // Shrinking first on ties, a character shrunk a little still fits the image.
+        std::stable_sort(ordered.begin(), ordered.end(), [](float a, float b) {
+            float distanceA = std::abs(a - 1.0f), distanceB = std::abs(b - 1.0f);
+            if(std::abs(distanceA - distanceB) > 1e-4f)
+                return distanceA < distanceB;
+            return a < b;
+        });
+        return ordered;
+    }();
+    return scalars;
+}
@@ -0,0 +1,160 @@
+#include "Log.hpp"
+
+#include <QDateTime>
+#include <QFile>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+    // Upper bound on the delay of a record if a wake up is missed.
+    constexpr std::chrono::milliseconds FLUSH_INTERVAL(50);
+}
+
+Logger::Logger()
+    : mRecords(new Record[RING_CAPACITY]),
+      mEnqueuePosition(0),
+      mDequeuePosition(0),
+      mDropped(0),
+      mStopping(false)
+{
+    for(size_t position = 0; position < RING_CAPACITY; ++position)
+        mRecords[position].sequence.store(position, std::memory_order_relaxed);
+
+    mWriter = std::thread(&Logger::pRun, this);
+}
+
+Logger::~Logger() {
+    mStopping.store(true);
+    mWake.notify_one();
+    mWriter.join();
+    mShutDown.store(true);
+}
+
+void
+Logger::logData(const int aLevel, const QString& aMethodLocation, const QString& aInfo) {
+    if(!isEnabled(aLevel) || mShutDown.load(std::memory_order_relaxed))
+        return;
+
+    QByteArray location = aMethodLocation.toUtf8();
+    QByteArray info = aInfo.toUtf8();
+    Logger& logger = getInstance();
+    if(logger.pPush(location.constData(), location.size(), info.constData(), info.size()))
+        logger.mWake.notify_one();
+}
+
+void
+Logger::logData(const int aLevel, const char* aMethodLocation, const char* aInfo) {
+    if(!isEnabled(aLevel) || mShutDown.load(std::memory_order_relaxed))
+        return;
+
+    Logger& logger = getInstance();
+    if(logger.pPush(aMethodLocation, std::strlen(aMethodLocation), aInfo, std::strlen(aInfo)))
+        logger.mWake.notify_one();
+}
+
+uint64_t
+Logger::getDroppedCount() {
+    return getInstance().mDropped.load(std::memory_order_relaxed);
+}
+
+bool
+Logger::pPush(const char* aMethodLocation, size_t aLocationLength, const char* aInfo, size_t aInfoLength) {
+    // Bounded MPMC queue from Dmitry Vyukov, used with a single consumer.
+    // http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+    size_t position = mEnqueuePosition.load(std::memory_order_relaxed);
+    Record* record;
+    while(true) {
+        record = &mRecords[position & (RING_CAPACITY - 1)];
+        size_t sequence = record->sequence.load(std::memory_order_acquire);
+        auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+        if(difference == 0) {
+            if(mEnqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        } else if(difference < 0) {
+            // Full, the writer is behind.
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            position = mEnqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    record->time = QDateTime::currentMSecsSinceEpoch();
+    size_t length = std::min(aLocationLength, RECORD_SIZE);
+    std::memcpy(record->text, aMethodLocation, length);
+    const char separator[] = ": ";
+    size_t separatorLength = std::min(sizeof(separator) - 1, RECORD_SIZE - length);
+    std::memcpy(record->text + length, separator, separatorLength);
+    length += separatorLength;
+    size_t infoLength = std::min(aInfoLength, RECORD_SIZE - length);
+    std::memcpy(record->text + length, aInfo, infoLength);
+    record->length = static_cast<uint32_t>(length + infoLength);
+
+    record->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+bool
+Logger::pHasRecord() const {
+    const Record& record = mRecords[mDequeuePosition & (RING_CAPACITY - 1)];
+    return record.sequence.load(std::memory_order_acquire) == mDequeuePosition + 1;
+}
+
+bool
+Logger::pPop(std::string& aBatch) {
+    if(!pHasRecord())
+        return false;
+
+    Record& record = mRecords[mDequeuePosition & (RING_CAPACITY - 1)];
+    aBatch += "[ ";
+    aBatch += QDateTime::fromMSecsSinceEpoch(record.time).toString("hh:mm:ss").toStdString();
+    aBatch += " ] ";
+    aBatch.append(record.text, record.length);
+    aBatch += '\n';
+
+    // Hand the slot back to the producers for the next lap.
+    record.sequence.store(mDequeuePosition + RING_CAPACITY, std::memory_order_release);
+    ++mDequeuePosition;
+    return true;
+}
+
+void
+Logger::pRun() {
+    QFile file(mOutputFileName);
+    file.open(QIODevice::ReadWrite | QIODevice::Text | QIODevice::Truncate);
+
+    std::string batch;
+    uint64_t reportedDrops = 0;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(mWakeMutex);
+            mWake.wait_for(lock, FLUSH_INTERVAL, [this]() { return mStopping.load() || pHasRecord(); });
+        }
+        const bool stopping = mStopping.load();
+
+        batch.clear();
+        while(pPop(batch)) {}
+
+        uint64_t dropped = mDropped.load(std::memory_order_relaxed);
+        if(dropped != reportedDrops) {
+            batch += "[ LOG ] " + std::to_string(dropped - reportedDrops) + " records dropped\n";
+            reportedDrops = dropped;
+        }
+
+        if(!batch.empty()) {
+            std::fwrite(batch.data(), 1, batch.size(), stderr);
+            if(file.isOpen()) {
+                file.write(batch.data(), static_cast<qint64>(batch.size()));
+                file.flush();
+            }
+        }
+
+        // Records pushed before stopping were drained above.
+        if(stopping)
+            break;
+    }
+    file.close();
+}
@@ -0,0 +1,299 @@
+#include "ModelFile.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <system_error>
+
+#include <QString>
+
+#include "Log.hpp"
+#include "SampleLog.hpp"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    constexpr char MODEL_MAGIC[8] = {'J', 'P', 'K', 'N', 'N', 'M', 'D', 'L'};
+    constexpr uint32_t MODEL_VERSION = 1;
+
+    // Read only mapping of a whole file. Unmapped once the last model using it is destroyed.
+    class FileMapping {
+    public:
+        static std::shared_ptr<FileMapping> open(const std::string& aFilepath);
+
+        FileMapping() = default;
+        ~FileMapping();
+
+        FileMapping(FileMapping const&) = delete;
+        void operator=(FileMapping const&) = delete;
+
+        const uint8_t* data() const { return mData; }
+
+        size_t size() const { return mSize; }
+
+    private:
+        const uint8_t* mData = nullptr;
+
+        size_t mSize = 0;
+
+#ifdef _WIN32
+        HANDLE mMapping = nullptr;
+#endif
+    };
+
+    std::shared_ptr<FileMapping>
+    FileMapping::open(const std::string& aFilepath) {
+        auto mapping = std::make_shared<FileMapping>();
+#ifdef _WIN32
+        HANDLE file = CreateFileA(aFilepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(file == INVALID_HANDLE_VALUE)
+            return nullptr;
+        LARGE_INTEGER fileSize;
+        if(!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            CloseHandle(file);
+            return nullptr;
+        }
+        mapping->mMapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        // The mapping keeps the file open.
+        CloseHandle(file);
+        if(!mapping->mMapping)
+            return nullptr;
+        void* address = MapViewOfFile(mapping->mMapping, FILE_MAP_READ, 0, 0, 0);
+        if(!address)
+            return nullptr;
+        mapping->mData = static_cast<const uint8_t*>(address);
+        mapping->mSize = static_cast<size_t>(fileSize.QuadPart);
+#else
+        int descriptor = ::open(aFilepath.c_str(), O_RDONLY);
+        if(descriptor < 0)
+            return nullptr;
+        struct stat status;
+        if(fstat(descriptor, &status) != 0 || status.st_size == 0) {
+            ::close(descriptor);
+            return nullptr;
+        }
+        // Shared read only mapping, backed by the page cache and shared between processes.
+        void* address = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, descriptor, 0);
+        // The mapping stays valid after the descriptor is closed.
+        ::close(descriptor);
+        if(address == MAP_FAILED)
+            return nullptr;
+        mapping->mData = static_cast<const uint8_t*>(address);
+        mapping->mSize = static_cast<size_t>(status.st_size);
+#endif
+        return mapping;
+    }
+
+    FileMapping::~FileMapping() {
+#ifdef _WIN32
+        if(mData)
+            UnmapViewOfFile(mData);
+        if(mMapping)
+            CloseHandle(mMapping);
+#else
+        if(mData)
+            munmap(const_cast<uint8_t*>(mData), mSize);
+#endif
+    }
+
+    bool
+    pSectionFits(uint64_t aOffset, uint64_t aLength, size_t aFileSize) {
+        return aOffset <= aFileSize && aLength <= aFileSize - aOffset;
+    }
+}
+
+ModelFileWriter::ModelFileWriter(const std::string& aFilepath)
+    : mFile(aFilepath, std::ios::binary | std::ios::trunc)
+{
+    // Reserve room for the header, it is written once the sample count is known.
+    ModelFileHeader placeholder{};
+    mFile.write(reinterpret_cast<const char*>(&placeholder), sizeof(placeholder));
+}
+
+bool
+ModelFileWriter::isOpen() const {
+    return mFile.is_open();
+}
+
+void
+ModelFileWriter::append(const uint8_t* aPackedRow, int aLabel) {
+    mFile.write(reinterpret_cast<const char*>(aPackedRow), FEATURE_ROW_STRIDE);
+    mResponses.push_back(aLabel);
+}
+
+bool
+ModelFileWriter::finish() {
+    if(!mFile.is_open())
+        return false;
+
+    std::vector<int32_t> labels = mResponses;
+    std::sort(labels.begin(), labels.end());
+    labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+
+    ModelFileHeader header{};
+    std::memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.headerSize = sizeof(ModelFileHeader);
+    header.imageDimension = IMAGE_DIMENSION;
+    header.featureEncoding = static_cast<uint32_t>(FeatureEncoding::PackedBits);
+    header.rowStride = FEATURE_ROW_STRIDE;
+    header.sampleCount = static_cast<uint32_t>(mResponses.size());
+    header.labelCount = static_cast<uint32_t>(labels.size());
+    header.samplesOffset = sizeof(ModelFileHeader);
+    header.responsesOffset = header.samplesOffset + static_cast<uint64_t>(header.sampleCount) * FEATURE_ROW_STRIDE;
+    header.labelsOffset = header.responsesOffset + static_cast<uint64_t>(header.sampleCount) * sizeof(int32_t);
+
+    mFile.write(reinterpret_cast<const char*>(mResponses.data()), mResponses.size() * sizeof(int32_t));
+    mFile.write(reinterpret_cast<const char*>(labels.data()), labels.size() * sizeof(int32_t));
+    mFile.seekp(0);
+    mFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    mFile.close();
+    return !mFile.fail();
+}
+
+int
+ModelFileWriter::getSampleCount() const {
+    return static_cast<int>(mResponses.size());
+}
+
+cv::Ptr<BinaryKNearest>
+ModelFile::load(const std::string& aFilepath, std::vector<int>* aLabelTable) {
+    auto model = BinaryKNearest::create();
+    auto mapping = FileMapping::open(aFilepath);
+    if(!mapping)
+        return model;
+
+    ModelFileHeader header;
+    if(mapping->size() < sizeof(header)) {
+        LOG(level::warning, "ModelFile::load()", QString::fromStdString(aFilepath) + " is truncated.");
+        return model;
+    }
+    std::memcpy(&header, mapping->data(), sizeof(header));
+
+    if(std::memcmp(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0 || header.version != MODEL_VERSION
+        || header.headerSize != sizeof(ModelFileHeader)) {
+        LOG(level::warning, "ModelFile::load()", QString::fromStdString(aFilepath) + " is not a model file.");
+        return model;
+    }
+    if(header.imageDimension != IMAGE_DIMENSION || header.rowStride != FEATURE_ROW_STRIDE
+        || header.featureEncoding != static_cast<uint32_t>(FeatureEncoding::PackedBits)) {
+        LOG(level::warning, "ModelFile::load()", QString::fromStdString(aFilepath) +
+            " was written for a different IMAGE_DIMENSION or feature encoding.");
+        return model;
+    }
+    if(header.samplesOffset % 64 != 0 || header.responsesOffset % sizeof(int32_t) != 0
+        || header.labelsOffset % sizeof(int32_t) != 0
+        || !pSectionFits(header.samplesOffset, static_cast<uint64_t>(header.sampleCount) * header.rowStride, mapping->size())
+        || !pSectionFits(header.responsesOffset, static_cast<uint64_t>(header.sampleCount) * sizeof(int32_t), mapping->size())
+        || !pSectionFits(header.labelsOffset, static_cast<uint64_t>(header.labelCount) * sizeof(int32_t), mapping->size())) {
+        LOG(level::warning, "ModelFile::load()", QString::fromStdString(aFilepath) + " is corrupted.");
+        return model;
+    }
+
+    // The mapping is read only. Neither matrix is ever written to.
+    auto* base = const_cast<uint8_t*>(mapping->data());
+    cv::Mat samples(static_cast<int>(header.sampleCount), FEATURE_ROW_STRIDE, CV_8U, base + header.samplesOffset);
+    cv::Mat responses(1, static_cast<int>(header.sampleCount), CV_32S, base + header.responsesOffset);
+
+    if(aLabelTable) {
+        const auto* labels = reinterpret_cast<const int32_t*>(mapping->data() + header.labelsOffset);
+        aLabelTable->assign(labels, labels + header.labelCount);
+    }
+
+    if(model->setPackedSamples(samples, responses, mapping))
+        LOG(level::standard, "ModelFile::load()", "Mapped " + QString::number(header.sampleCount) +
+            " samples from " + QString::fromStdString(aFilepath));
+    return model;
+}
+
+bool
+ModelFile::save(const BinaryKNearest& aModel, const std::string& aFilepath) {
+    ModelFileWriter writer(aFilepath);
+    if(!writer.isOpen())
+        return false;
+
+    const cv::Mat& samples = aModel.getPackedSamples();
+    const cv::Mat& responses = aModel.getResponses();
+    for(int row = 0; row < aModel.getSampleCount(); ++row)
+        writer.append(samples.ptr<uint8_t>(row), responses.at<int>(row));
+    return writer.finish();
+}
+
+bool
+ModelFile::convertFromOpknn(const std::string& aOpknnFilepath, const std::string& aFilepath) {
+    cv::Ptr<BinaryKNearest> model = BinaryKNearest::load(aOpknnFilepath);
+    if(model->empty())
+        return false;
+    return ModelFile::save(*model, aFilepath);
+}
+
+int
+ModelFile::mergeSampleLog(const std::string& aFilepath, const std::string& aLogFilepath) {
+    cv::Mat logSamples;
+    std::vector<int> logLabels;
+    if(!SampleLog::read(aLogFilepath, logSamples, logLabels) || logLabels.empty())
+        return 0;
+
+    const std::string mergedFilepath = aFilepath + ".merge";
+    std::error_code error;
+    {
+        cv::Ptr<BinaryKNearest> model = ModelFile::load(aFilepath);
+        if(model->empty())
+            return -1;
+
+        ModelFileWriter writer(mergedFilepath);
+        const cv::Mat& samples = model->getPackedSamples();
+        const cv::Mat& responses = model->getResponses();
+        for(int row = 0; row < model->getSampleCount(); ++row)
+            writer.append(samples.ptr<uint8_t>(row), responses.at<int>(row));
+        for(int row = 0; row < logSamples.rows; ++row)
+            writer.append(logSamples.ptr<uint8_t>(row), logLabels[row]);
+        if(!writer.finish()) {
+            std::filesystem::remove(mergedFilepath, error);
+            return -1;
+        }
+    }
+
+    // The log is moved out of the way before the model is replaced. Left in place, e.g. if
+    // it could not be deleted, its samples would be counted twice and merged again.
+    const std::string mergedLogFilepath = aLogFilepath + ".merged";
+    std::filesystem::rename(aLogFilepath, mergedLogFilepath, error);
+    if(error) {
+        LOG(level::error, "ModelFile::mergeSampleLog()", "Unable to move " + QString::fromStdString(aLogFilepath)
+            + ": " + QString::fromStdString(error.message()));
+        std::filesystem::remove(mergedFilepath, error);
+        return -1;
+    }
+
+    // The model is unmapped once its last reference is gone, it can be replaced.
+    std::filesystem::rename(mergedFilepath, aFilepath, error);
+    if(error) {
+        LOG(level::error, "ModelFile::mergeSampleLog()", "Unable to replace " + QString::fromStdString(aFilepath)
+            + ": " + QString::fromStdString(error.message()));
+        std::filesystem::remove(mergedFilepath, error);
+        // The samples are still only in the log.
+        std::filesystem::rename(mergedLogFilepath, aLogFilepath, error);
+        return -1;
+    }
+    // Nothing reads it anymore, a leftover is simply replaced by the next merge.
+    std::filesystem::remove(mergedLogFilepath, error);
+
+    LOG(level::standard, "ModelFile::mergeSampleLog()", "Merged " + QString::number(logLabels.size())
+        + " samples into " + QString::fromStdString(aFilepath));
+    return static_cast<int>(logLabels.size());
+}
@@ -0,0 +1,69 @@
+#include "RecognitionCache.hpp"
+
+void
+RecognitionCache::Fingerprint::add(const void* aData, size_t aSize) {
+    const auto* bytes = static_cast<const unsigned char*>(aData);
+    for(size_t byte = 0; byte < aSize; ++byte) {
+        mHash ^= bytes[byte];
+        mHash *= 1099511628211ull;
+    }
+}
+
+RecognitionCache::RecognitionCache(size_t aCapacity)
+    : mCapacity(aCapacity > 0 ? aCapacity : 1),
+      mHits(0),
+      mMisses(0)
+{
+    mIndex.reserve(mCapacity);
+}
+
+std::optional<RecognitionResult>
+RecognitionCache::find(uint64_t aFingerprint) {
+    auto entry = mIndex.find(aFingerprint);
+    if(entry == mIndex.end()) {
+        ++mMisses;
+        return std::nullopt;
+    }
+
+    ++mHits;
+    mEntries.splice(mEntries.begin(), mEntries, entry->second);
+    return entry->second->second;
+}
+
+void
+RecognitionCache::insert(uint64_t aFingerprint, const RecognitionResult& aResult) {
+    auto entry = mIndex.find(aFingerprint);
+    if(entry != mIndex.end()) {
+        entry->second->second = aResult;
+        mEntries.splice(mEntries.begin(), mEntries, entry->second);
+        return;
+    }
+
+    if(mEntries.size() >= mCapacity) {
+        mIndex.erase(mEntries.back().first);
+        mEntries.pop_back();
+    }
+    mEntries.emplace_front(aFingerprint, aResult);
+    mIndex[aFingerprint] = mEntries.begin();
+}
+
+void
+RecognitionCache::clear() {
+    mEntries.clear();
+    mIndex.clear();
+}
+
+size_t
+RecognitionCache::size() const {
+    return mEntries.size();
+}
+
+uint64_t
+RecognitionCache::getHits() const {
+    return mHits;
+}
+
+uint64_t
+RecognitionCache::getMisses() const {
+    return mMisses;
+}
@@ -0,0 +1,457 @@
+#include "RecognitionExecutor.hpp"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <QThread>
+#include <QtConcurrent/QtConcurrentRun>
+
+#include "opencv2/imgproc.hpp"
+
+#include "ImageProcessMethods.hpp"
+#include "Log.hpp"
+#include "Trace.hpp"
+#include "WorkStealingPool.hpp"
+
+namespace {
+    // Enough for the scales of several dozen requests. The cache is simply cleared once full.
+    constexpr size_t FEATURE_CACHE_CAPACITY = 512;
+
+    // Candidates kept in a result.
+    constexpr size_t TOP_CANDIDATES = 5;
+
+    // Scales searched by the first batches, nearest to 1.0 first. The remaining
+    // scales are searched together.
+    const std::vector<size_t> ADAPTIVE_BATCH_SIZES = {1, 2};
+
+    // Same boundaries when the scales of a batch run in parallel, with the first two
+    // batches merged: a single scale can never be clear, so the results are the same.
+    const std::vector<size_t> PARALLEL_BATCH_SIZES = {3};
+
+    // Recognition stops before every scale was searched once the predicted label
+    // leads the runner up by this many scales...
+    constexpr int EARLY_EXIT_LEAD = 3;
+
+    // ...with at least this confidence, e.g. three agreeing scales with 3 of 4
+    // neighbours each agreeing too.
+    constexpr float EARLY_EXIT_CONFIDENCE = .75f;
+
+    // Buffers of a worker thread, reused by every request it runs.
+    struct Workspace {
+        cv::Mat canvas;
+        ImageMethods::FeatureWorkspace features;
+        cv::Mat packed;
+        cv::Mat queries;
+        cv::Mat results;
+        cv::Mat neighbours;
+        cv::Mat distances;
+        std::vector<uint64_t> hashes;
+        std::vector<int> missing;
+        std::vector<float> scalars;
+        std::vector<RecognitionExecutor::ScaleResult> scales;
+        std::vector<std::vector<RecognitionExecutor::ScaleResult>> scaleResults;
+        std::vector<char> scaleSucceeded;
+
+        // Size every buffer for aScaleCount scales. The batches of a request only take
+        // row ranges, so whatever their sizes nothing is allocated once this was done.
+        void reserve(int aScaleCount) {
+            if(packed.rows >= aScaleCount)
+                return;
+            features.features.create(aScaleCount, IMAGE_DIMENSION * IMAGE_DIMENSION, CV_32F);
+            packed.create(aScaleCount, FEATURE_ROW_STRIDE, CV_8U);
+            queries.create(aScaleCount, IMAGE_DIMENSION * IMAGE_DIMENSION, CV_32F);
+            results.create(aScaleCount, 1, CV_32F);
+            neighbours.create(aScaleCount, KNN_NEIGHBOURS, CV_32F);
+            distances.create(aScaleCount, KNN_NEIGHBOURS, CV_32F);
+            hashes.resize(aScaleCount);
+            missing.reserve(aScaleCount);
+            scalars.reserve(aScaleCount);
+            scales.reserve(aScaleCount);
+            scaleResults.resize(aScaleCount);
+            scaleSucceeded.reserve(aScaleCount);
+        }
+    };
+
+    // Buffers of the calling thread, reused by every request it runs. After the first
+    // request the canvas is read back and the features are prepared without allocating.
+    Workspace&
+    pThreadWorkspace() {
+        thread_local Workspace workspace;
+        return workspace;
+    }
+
+    // FNV-1a over a packed feature row.
+    uint64_t
+    pHashFeature(const uint8_t* aPackedRow) {
+        uint64_t hash = 14695981039346656037ull;
+        for(int byte = 0; byte < FEATURE_BYTES; ++byte) {
+            hash ^= aPackedRow[byte];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+}
+
+RecognitionExecutor::RecognitionExecutor(QObject* parent)
+    : QObject(parent),
+      mLatestRequest(std::make_shared<std::atomic<quint64>>(0)),
+      mFeatureCache(std::make_shared<FeatureCache>())
+{
+    qRegisterMetaType<RecognitionResult>();
+    mPool.setMaxThreadCount(std::max(1, QThread::idealThreadCount()));
+    // Workers never expire. A new thread would allocate its thread_local buffers
+    // again, the first requests after every idle pause would pay for them.
+    mPool.setExpiryTimeout(-1);
+
+    // Workers emit from their own thread, results are handed over to the owning thread.
+    QObject::connect(this, &RecognitionExecutor::workerFinished,
+                     this, &RecognitionExecutor::pDeliver, Qt::QueuedConnection);
+}
+
+RecognitionExecutor::~RecognitionExecutor() {
+    cancel();
+    mPool.waitForDone();
+}
+
+void
+RecognitionExecutor::setModels(const cv::Ptr<BinaryKNearest>& aBinaryKnn, const cv::Ptr<cv::ml::KNearest>& aKnn) {
+    mBinaryKnn = aBinaryKnn;
+    mKnn = aKnn;
+    // Cached results were predicted by the previous models.
+    clearCaches();
+}
+
+void
+RecognitionExecutor::clearCaches() {
+    // Requests in flight keep filling the cache they started with.
+    mFeatureCache = std::make_shared<FeatureCache>();
+    mResultCache.clear();
+    mCacheClearedAt = mLatestRequest->load();
+}
+
+quint64
+RecognitionExecutor::submit(const QImage& aSnapshot, const QRect& aInkBounds, quint64 aFingerprint) {
+    const quint64 request = ++(*mLatestRequest);
+
+    if(aFingerprint != 0) {
+        if(auto cached = mResultCache.find(aFingerprint)) {
+            emit recognized(*cached);
+            return request;
+        }
+    }
+
+    // Everything the worker needs is captured by value, only the request counter
+    // and the feature cache are shared.
+    auto latestRequest = mLatestRequest;
+    auto binaryKnn = mBinaryKnn;
+    auto knn = mKnn;
+    auto featureCache = mFeatureCache;
+    const bool parallelScales = mParallelScales;
+    QtConcurrent::run(&mPool, [this, request, latestRequest, binaryKnn, knn, featureCache, parallelScales, aSnapshot,
+                               aInkBounds, aFingerprint]() {
+        auto superseded = [&latestRequest, request]() { return latestRequest->load() != request; };
+        std::optional<RecognitionResult> result = pRecognize(aSnapshot, binaryKnn, knn, aInkBounds, *featureCache,
+                                                             parallelScales, superseded);
+        if(!result)
+            return;
+        // Cached along with the result, a cache hit describes the same drawing.
+        result->fingerprint = aFingerprint;
+        emit workerFinished(request, aFingerprint, *result);
+    });
+
+    return request;
+}
+
+void
+RecognitionExecutor::setParallelScales(bool aParallelScales) {
+    mParallelScales = aParallelScales;
+}
+
+void
+RecognitionExecutor::cancel() {
+    ++(*mLatestRequest);
+}
+
+const RecognitionCache&
+RecognitionExecutor::getResultCache() const {
+    return mResultCache;
+}
+
+RecognitionResult
+RecognitionExecutor::buildResult(const std::vector<ScaleResult>& aScales) {
+    if(aScales.empty())
+        return RecognitionResult();
+
+    std::vector<int> labels;
+    labels.reserve(aScales.size());
+    for(const ScaleResult& scale : aScales)
+        labels.push_back(scale.label);
+
+    RecognitionResult result;
+    result.label = ImageMethods::findMostFrequentLabel(labels);
+
+    std::map<int, RecognitionResult::Candidate> candidates;
+    float agreement = 0.0f;
+    for(const ScaleResult& scale : aScales) {
+        result.distances.push_back(scale.distances[0]);
+        int agreeing = 0;
+        for(int neighbour = 0; neighbour < KNN_NEIGHBOURS; ++neighbour) {
+            const int label = static_cast<int>(scale.neighbours[neighbour]);
+            auto candidate = candidates.try_emplace(label, RecognitionResult::Candidate{label, 0, scale.distances[neighbour]}).first;
+            candidate->second.distance = std::min(candidate->second.distance, scale.distances[neighbour]);
+            agreeing += label == result.label;
+        }
+        candidates.try_emplace(scale.label, RecognitionResult::Candidate{scale.label, 0, scale.distances[0]}).first->second.votes++;
+        if(scale.label == result.label)
+            agreement += static_cast<float>(agreeing) / KNN_NEIGHBOURS;
+    }
+
+    for(const auto& candidate : candidates)
+        result.candidates.push_back(candidate.second);
+    const int predicted = result.label;
+    std::sort(result.candidates.begin(), result.candidates.end(),
+              [predicted](const RecognitionResult::Candidate& a, const RecognitionResult::Candidate& b) {
+        if((a.label == predicted) != (b.label == predicted))
+            return a.label == predicted;
+        if(a.votes != b.votes)
+            return a.votes > b.votes;
+        return a.distance < b.distance;
+    });
+    if(result.candidates.size() > TOP_CANDIDATES)
+        result.candidates.resize(TOP_CANDIDATES);
+
+    // Share of the scales voting for the label, weighted by how many of
+    // their neighbours agree with it.
+    const int votes = result.candidates.front().votes;
+    result.confidence = votes > 0
+        ? (static_cast<float>(votes) / aScales.size()) * (agreement / votes)
+        : 0.0f;
+    return result;
+}
+
+bool
+RecognitionExecutor::isClear(const RecognitionResult& aResult) {
+    if(aResult.candidates.empty())
+        return false;
+    const int votes = aResult.candidates.front().votes;
+    const int runnerUp = aResult.candidates.size() > 1 ? aResult.candidates[1].votes : 0;
+    return votes - runnerUp >= EARLY_EXIT_LEAD && aResult.confidence >= EARLY_EXIT_CONFIDENCE;
+}
+
+void
+RecognitionExecutor::pDeliver(quint64 aRequest, quint64 aFingerprint, const RecognitionResult& aResult) {
+    // Even a superseded result still describes its drawing, unless it was
+    // submitted before the caches were cleared.
+    if(aFingerprint != 0 && aRequest > mCacheClearedAt)
+        mResultCache.insert(aFingerprint, aResult);
+    if(aRequest != mLatestRequest->load())
+        return;
+    emit recognized(aResult);
+}
+
+std::optional<RecognitionResult>
+RecognitionExecutor::pRecognize(const QImage& aSnapshot, const cv::Ptr<BinaryKNearest>& aBinaryKnn,
+                                const cv::Ptr<cv::ml::KNearest>& aKnn, const QRect& aInkBounds,
+                                FeatureCache& aFeatureCache, bool aParallelScales,
+                                const std::function<bool()>& aSuperseded) {
+    if(aSuperseded())
+        return std::nullopt;
+    TRACE_SPAN(Recognition);
+
+    // The snapshot shares the canvas raster, it is read once to get the inverted
+    // (white-fg black-bg) grayscale image.
+    Workspace& workspace = pThreadWorkspace();
+    {
+        TRACE_SPAN(Readback);
+        ImageMethods::qImageToInvertedGray(aSnapshot, workspace.canvas);
+    }
+    if(aSuperseded())
+        return std::nullopt;
+
+    const cv::Rect searchArea(aInkBounds.x(), aInkBounds.y(), aInkBounds.width(), aInkBounds.height());
+    return recognize(workspace.canvas, aInkBounds.isNull() ? cv::Rect() : searchArea, aBinaryKnn, aKnn,
+                     aParallelScales, &aFeatureCache, aSuperseded);
+}
+
+std::optional<RecognitionResult>
+RecognitionExecutor::recognize(const cv::Mat& aCanvas, const cv::Rect& aSearchArea,
+                               const cv::Ptr<BinaryKNearest>& aBinaryKnn, const cv::Ptr<cv::ml::KNearest>& aKnn,
+                               bool aParallelScales, FeatureCache* aFeatureCache,
+                               const std::function<bool()>& aSuperseded) {
+    auto superseded = [&aSuperseded]() { return aSuperseded && aSuperseded(); };
+    Workspace& workspace = pThreadWorkspace();
+
+    // Only the area holding the strokes is searched, the cost of the ROI does not
+    // depend on the size of the canvas.
+    cv::Rect roi;
+    {
+        TRACE_SPAN(ROIExtraction);
+        roi = aSearchArea.empty()
+            ? ImageMethods::obtainROI(aCanvas)
+            : ImageMethods::obtainROI(aCanvas, aSearchArea);
+    }
+    // Nothing drawn, or too little ink to rescale. Still delivered, so whatever
+    // was shown for an earlier drawing is cleared.
+    if(roi.empty())
+        return RecognitionResult();
+    if(superseded())
+        return std::nullopt;
+
+    const bool useBinary = aBinaryKnn && !aBinaryKnn->empty();
+    if(!useBinary && !aKnn) {
+        LOG(level::warning, "RecognitionExecutor::recognize()", "No kNN model set.");
+        return std::nullopt;
+    }
+
+    // Features of a batch of scales are prepared and searched together, with the buffers
+    // of aWorkspace. One result per scale fitting the canvas is appended to aScales, in
+    // order. Only the scales whose features were never seen before go through the model.
+    auto searchScales = [&](const std::vector<float>& aScalars, Workspace& aWorkspace,
+                            std::vector<ScaleResult>& aScales) {
+        cv::Mat features;
+        {
+            TRACE_SPAN(Rescaling);
+            features = ImageMethods::rescaleROIToFeatures(aScalars, aCanvas, roi, aWorkspace.features);
+        }
+        // None of the scales fit the canvas.
+        if(features.empty())
+            return true;
+
+        // Sized for every scale by Workspace::reserve(), a batch only uses the first rows.
+        aWorkspace.missing.clear();
+        auto& hashes = aWorkspace.hashes;
+        auto& missing = aWorkspace.missing;
+        const size_t firstScale = aScales.size();
+        aScales.resize(firstScale + features.rows);
+        {
+            TRACE_SPAN(FeaturePreparation);
+            for(int row = 0; row < features.rows; ++row) {
+                BinaryFeatures::packRow(features.row(row), aWorkspace.packed.ptr<uint8_t>(row));
+                hashes[row] = pHashFeature(aWorkspace.packed.ptr<uint8_t>(row));
+            }
+            if(aFeatureCache) {
+                std::lock_guard<std::mutex> lock(aFeatureCache->mutex);
+                for(int row = 0; row < features.rows; ++row) {
+                    auto cached = aFeatureCache->scales.find(hashes[row]);
+                    if(cached != aFeatureCache->scales.end())
+                        aScales[firstScale + row] = cached->second;
+                    else
+                        missing.push_back(row);
+                }
+            } else {
+                for(int row = 0; row < features.rows; ++row)
+                    missing.push_back(row);
+            }
+        }
+        if(missing.empty())
+            return true;
+
+        cv::Mat queries = aWorkspace.queries.rowRange(0, static_cast<int>(missing.size()));
+        for(size_t index = 0; index < missing.size(); ++index)
+            features.row(missing[index]).copyTo(queries.row(static_cast<int>(index)));
+
+        // Views of the first rows. A search giving another size, e.g. with fewer samples than
+        // KNN_NEIGHBOURS, reallocates the view only and the results are still read from it.
+        const cv::Range queryRows(0, queries.rows);
+        cv::Mat output = aWorkspace.results.rowRange(queryRows);
+        cv::Mat neighbours = aWorkspace.neighbours.rowRange(queryRows);
+        cv::Mat distances = aWorkspace.distances.rowRange(queryRows);
+        try {
+            TRACE_SPAN(KNNSearch);
+            if(useBinary)
+                aBinaryKnn->findNearest(queries, KNN_NEIGHBOURS, output, neighbours, distances);
+            else
+                aKnn->findNearest(queries, KNN_NEIGHBOURS, output, neighbours, distances);
+        } catch(const cv::Exception& ex) {
+            LOG(level::error, "RecognitionExecutor::recognize()", ex.what());
+            return false;
+        }
+
+        for(size_t index = 0; index < missing.size(); ++index) {
+            const int queryRow = static_cast<int>(index);
+            ScaleResult& scale = aScales[firstScale + missing[index]];
+            scale.label = static_cast<int>(output.at<float>(queryRow));
+            for(int neighbour = 0; neighbour < KNN_NEIGHBOURS; ++neighbour) {
+                scale.neighbours[neighbour] = neighbours.at<float>(queryRow, neighbour);
+                scale.distances[neighbour] = distances.at<float>(queryRow, neighbour);
+            }
+        }
+
+        if(!aFeatureCache)
+            return true;
+        std::lock_guard<std::mutex> lock(aFeatureCache->mutex);
+        if(aFeatureCache->scales.size() + missing.size() > FEATURE_CACHE_CAPACITY)
+            aFeatureCache->scales.clear();
+        for(int row : missing)
+            aFeatureCache->scales[hashes[row]] = aScales[firstScale + row];
+        return true;
+    };
+
+    // Sized once for every scale, the early exit leaves batches of varying sizes.
+    const std::vector<float>& scalars = TechniqueMethods::ROIRescalingScalarsByDistance();
+    workspace.reserve(static_cast<int>(scalars.size()));
+    std::vector<ScaleResult>& scales = workspace.scales;
+    std::vector<std::vector<ScaleResult>>& scaleResults = workspace.scaleResults;
+    std::vector<char>& scaleSucceeded = workspace.scaleSucceeded;
+    scales.clear();
+
+    // Every scale of the batch is rescaled, prepared and searched by its own task on
+    // the shared pool. Results are appended in the order of the scalars whatever the
+    // order the tasks finish in, the vote sees exactly what the serial search gives.
+    auto searchBatch = [&](const std::vector<float>& aScalars) {
+        if(!aParallelScales || aScalars.size() < 2)
+            return searchScales(aScalars, workspace, scales);
+
+        for(size_t index = 0; index < aScalars.size(); ++index)
+            scaleResults[index].clear();
+        scaleSucceeded.assign(aScalars.size(), 0);
+        WorkStealingPool::getShared().parallelFor(aScalars.size(), [&](size_t aIndex) {
+            thread_local Workspace scaleWorkspace;
+            scaleWorkspace.reserve(1);
+            scaleWorkspace.scalars.assign(1, aScalars[aIndex]);
+            scaleSucceeded[aIndex] = searchScales(scaleWorkspace.scalars, scaleWorkspace, scaleResults[aIndex]);
+        });
+
+        for(size_t index = 0; index < aScalars.size(); ++index) {
+            if(!scaleSucceeded[index])
+                return false;
+            scales.insert(scales.end(), scaleResults[index].begin(), scaleResults[index].end());
+        }
+        return true;
+    };
+
+    // Scales closest to the drawn size go first. Once they agree clearly enough
+    // the remaining scales are never rescaled nor searched.
+    std::vector<float>& batch = workspace.scalars;
+    const std::vector<size_t>& batchSizes = aParallelScales ? PARALLEL_BATCH_SIZES : ADAPTIVE_BATCH_SIZES;
+    auto next = scalars.begin();
+    for(size_t batchIndex = 0; next != scalars.end(); ++batchIndex) {
+        const size_t batchSize = batchIndex < batchSizes.size()
+            ? batchSizes[batchIndex]
+            : static_cast<size_t>(scalars.end() - next);
+        const size_t taken = std::min(batchSize, static_cast<size_t>(scalars.end() - next));
+        batch.assign(next, next + taken);
+        next += taken;
+
+        if(!searchBatch(batch))
+            return std::nullopt;
+        if(superseded())
+            return std::nullopt;
+
+        if(next != scalars.end() && !scales.empty()) {
+            TRACE_SPAN(Voting);
+            RecognitionResult partial = buildResult(scales);
+            if(isClear(partial))
+                return partial;
+        }
+    }
+
+    if(scales.empty()) {
+        LOG(level::warning, "RecognitionExecutor::recognize()", "The ROI does not fit any scale.");
+        return RecognitionResult();
+    }
+
+    TRACE_SPAN(Voting);
+    return buildResult(scales);
+}
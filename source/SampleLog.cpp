@@ -0,0 +1,91 @@
+#include "SampleLog.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+
+namespace {
+    constexpr char LOG_MAGIC[8] = {'J', 'P', 'K', 'N', 'N', 'L', 'O', 'G'};
+    constexpr uint32_t LOG_VERSION = 1;
+
+    constexpr size_t RECORD_SIZE = sizeof(int32_t) + FEATURE_BYTES;
+
+    bool
+    pReadHeader(std::istream& aFile) {
+        SampleLogHeader header{};
+        aFile.read(reinterpret_cast<char*>(&header), sizeof(header));
+        return aFile && std::memcmp(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC)) == 0
+            && header.version == LOG_VERSION && header.featureBytes == FEATURE_BYTES;
+    }
+}
+
+SampleLog::SampleLog(const std::string& aFilepath) {
+    std::error_code error;
+    const uintmax_t size = std::filesystem::file_size(aFilepath, error);
+    if(error || size < sizeof(SampleLogHeader)) {
+        SampleLogHeader header{};
+        std::memcpy(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+        header.version = LOG_VERSION;
+        header.featureBytes = FEATURE_BYTES;
+        mFile.open(aFilepath, std::ios::binary | std::ios::trunc);
+        mFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        mFile.flush();
+        return;
+    }
+
+    {
+        std::ifstream file(aFilepath, std::ios::binary);
+        if(!pReadHeader(file))
+            return;
+    }
+    // Appending after a partial record would shift every later one.
+    const uintmax_t records = (size - sizeof(SampleLogHeader)) / RECORD_SIZE;
+    const uintmax_t completeSize = sizeof(SampleLogHeader) + records * RECORD_SIZE;
+    if(completeSize != size)
+        std::filesystem::resize_file(aFilepath, completeSize, error);
+    if(!error)
+        mFile.open(aFilepath, std::ios::binary | std::ios::app);
+}
+
+bool
+SampleLog::isOpen() const {
+    return mFile.is_open();
+}
+
+bool
+SampleLog::append(const uint8_t* aPackedRow, int aLabel) {
+    if(!mFile.is_open())
+        return false;
+
+    char record[RECORD_SIZE];
+    const int32_t label = aLabel;
+    std::memcpy(record, &label, sizeof(label));
+    std::memcpy(record + sizeof(label), aPackedRow, FEATURE_BYTES);
+    mFile.write(record, sizeof(record));
+    mFile.flush();
+    return static_cast<bool>(mFile);
+}
+
+bool
+SampleLog::read(const std::string& aFilepath, cv::Mat& aPackedSamples, std::vector<int>& aLabels) {
+    std::ifstream file(aFilepath, std::ios::binary);
+    if(!file || !pReadHeader(file))
+        return false;
+
+    aLabels.clear();
+    std::vector<uint8_t> rows;
+    char record[RECORD_SIZE];
+    while(file.read(record, sizeof(record))) {
+        int32_t label;
+        std::memcpy(&label, record, sizeof(label));
+        aLabels.push_back(label);
+        // Stored without the padding, which is zero.
+        rows.insert(rows.end(), record + sizeof(label), record + sizeof(record));
+        rows.insert(rows.end(), FEATURE_ROW_STRIDE - FEATURE_BYTES, 0);
+    }
+
+    aPackedSamples.create(static_cast<int>(aLabels.size()), FEATURE_ROW_STRIDE, CV_8U);
+    if(!rows.empty())
+        std::memcpy(aPackedSamples.data, rows.data(), rows.size());
+    return true;
+}
@@ -0,0 +1,260 @@
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace {
+    // Values below 2^SUB_BUCKET_BITS ns get a bucket each, larger values get
+    // 2^SUB_BUCKET_BITS buckets per power of two.
+    constexpr int SUB_BUCKET_BITS = 4;
+    constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    constexpr int BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    constexpr size_t STAGE_COUNT = static_cast<size_t>(Trace::Stage::Count);
+
+    int
+    pBucket(uint64_t aValue) {
+        if(aValue < SUB_BUCKETS)
+            return static_cast<int>(aValue);
+#if defined(_MSC_VER)
+        unsigned long exponent;
+        _BitScanReverse64(&exponent, aValue);
+#else
+        int exponent = 63 - __builtin_clzll(aValue);
+#endif
+        int subBucket = static_cast<int>(aValue >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + subBucket;
+    }
+
+    // Middle of the values falling in aBucket.
+    double
+    pBucketValue(int aBucket) {
+        if(aBucket < SUB_BUCKETS)
+            return aBucket;
+        int exponent = aBucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        uint64_t lower = static_cast<uint64_t>(SUB_BUCKETS + aBucket % SUB_BUCKETS) << (exponent - SUB_BUCKET_BITS);
+        uint64_t width = 1ull << (exponent - SUB_BUCKET_BITS);
+        return lower + (width - 1) / 2.0;
+    }
+
+    // Only written by the thread holding the recorder, so plain loads and stores are enough.
+    template<typename T>
+    void
+    pAdd(std::atomic<T>& aCounter, T aValue) {
+        aCounter.store(aCounter.load(std::memory_order_relaxed) + aValue, std::memory_order_relaxed);
+    }
+
+    struct Histogram {
+        std::array<std::atomic<uint32_t>, BUCKET_COUNT> buckets{};
+        std::atomic<uint64_t> max{0};
+    };
+
+    struct Event {
+        std::atomic<uint64_t> start{0};
+        // Duration in the upper 56 bits, stage in the lower 8.
+        std::atomic<uint64_t> durationAndStage{0};
+    };
+
+    struct ThreadRecorder {
+        int threadIndex = 0;
+        std::array<Histogram, STAGE_COUNT> histograms;
+        std::array<Event, Trace::EVENT_CAPACITY> events;
+        std::atomic<uint64_t> eventCount{0};
+    };
+
+    // Recorders outlive their thread, their spans are still reported once it exited.
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadRecorder>> recorders;
+        // Recorders of exited threads, handed to the next new threads. Threads come and
+        // go with the pools, only as many recorders are created as threads run at once.
+        std::vector<ThreadRecorder*> released;
+    };
+
+    // Never destroyed, workers may still record while statics are torn down at exit.
+    Registry&
+    pRegistry() {
+        static Registry* registry = new Registry;
+        return *registry;
+    }
+
+    // Hands the recorder of a thread back to the registry when the thread exits.
+    struct RecorderLease {
+        ThreadRecorder* recorder = nullptr;
+
+        ~RecorderLease() {
+            if(!recorder)
+                return;
+            Registry& registry = pRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.released.push_back(recorder);
+        }
+    };
+
+    // A reused recorder keeps its spans and its thread index, later spans are
+    // simply reported as if they came from the same thread.
+    ThreadRecorder&
+    pThreadRecorder() {
+        thread_local RecorderLease lease;
+        if(!lease.recorder) {
+            Registry& registry = pRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            if(!registry.released.empty()) {
+                lease.recorder = registry.released.back();
+                registry.released.pop_back();
+            } else {
+                registry.recorders.push_back(std::make_unique<ThreadRecorder>());
+                lease.recorder = registry.recorders.back().get();
+                lease.recorder->threadIndex = static_cast<int>(registry.recorders.size());
+            }
+        }
+        return *lease.recorder;
+    }
+
+    const auto sEpoch = std::chrono::steady_clock::now();
+}
+
+const char*
+Trace::stageName(Stage aStage) {
+    switch(aStage) {
+        case Stage::Recognition: return "recognition";
+        case Stage::Readback: return "readback";
+        case Stage::ROIExtraction: return "roi_extraction";
+        case Stage::Rescaling: return "rescaling";
+        case Stage::FeaturePreparation: return "feature_preparation";
+        case Stage::KNNSearch: return "knn_search";
+        case Stage::Voting: return "voting";
+        default: return "unknown";
+    }
+}
+
+uint64_t
+Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - sEpoch).count();
+}
+
+void
+Trace::record(Stage aStage, uint64_t aStart, uint64_t aEnd) {
+    ThreadRecorder& recorder = pThreadRecorder();
+    const uint64_t duration = aEnd > aStart ? aEnd - aStart : 0;
+
+    Histogram& histogram = recorder.histograms[static_cast<size_t>(aStage)];
+    pAdd(histogram.buckets[pBucket(duration)], 1u);
+    if(duration > histogram.max.load(std::memory_order_relaxed))
+        histogram.max.store(duration, std::memory_order_relaxed);
+
+    const uint64_t eventIndex = recorder.eventCount.load(std::memory_order_relaxed);
+    Event& event = recorder.events[eventIndex % EVENT_CAPACITY];
+    event.start.store(aStart, std::memory_order_relaxed);
+    event.durationAndStage.store((duration << 8) | static_cast<uint64_t>(aStage), std::memory_order_relaxed);
+    recorder.eventCount.store(eventIndex + 1, std::memory_order_release);
+}
+
+std::vector<Trace::Summary>
+Trace::summarize() {
+    std::array<std::vector<uint64_t>, STAGE_COUNT> buckets;
+    std::array<uint64_t, STAGE_COUNT> counts{};
+    std::array<uint64_t, STAGE_COUNT> maxima{};
+    for(auto& stageBuckets : buckets)
+        stageBuckets.assign(BUCKET_COUNT, 0);
+
+    {
+        Registry& registry = pRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for(const auto& recorder : registry.recorders) {
+            for(size_t stage = 0; stage < STAGE_COUNT; ++stage) {
+                const Histogram& histogram = recorder->histograms[stage];
+                for(int bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+                    uint32_t count = histogram.buckets[bucket].load(std::memory_order_relaxed);
+                    buckets[stage][bucket] += count;
+                    counts[stage] += count;
+                }
+                maxima[stage] = std::max(maxima[stage], histogram.max.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    std::vector<Summary> summaries;
+    for(size_t stage = 0; stage < STAGE_COUNT; ++stage) {
+        if(counts[stage] == 0)
+            continue;
+
+        auto percentile = [&](double aFraction) {
+            const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(aFraction * counts[stage] + 0.5));
+            uint64_t seen = 0;
+            for(int bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+                seen += buckets[stage][bucket];
+                if(seen >= rank)
+                    return std::min(pBucketValue(bucket), static_cast<double>(maxima[stage])) / 1000.0;
+            }
+            return maxima[stage] / 1000.0;
+        };
+
+        summaries.push_back({static_cast<Stage>(stage), counts[stage], percentile(.50), percentile(.95),
+                             percentile(.99), maxima[stage] / 1000.0});
+    }
+    return summaries;
+}
+
+void
+Trace::dumpSummary(std::ostream& aStream) {
+    std::vector<Summary> summaries = summarize();
+    if(summaries.empty()) {
+        aStream << "No spans recorded\n";
+        return;
+    }
+
+    aStream << std::left << std::setw(22) << "STAGE" << std::right << std::setw(10) << "COUNT"
+            << std::setw(12) << "P50 (us)" << std::setw(12) << "P95 (us)" << std::setw(12) << "P99 (us)"
+            << std::setw(12) << "MAX (us)" << "\n";
+    aStream << std::fixed << std::setprecision(1);
+    for(const Summary& summary : summaries) {
+        aStream << std::left << std::setw(22) << stageName(summary.stage) << std::right
+                << std::setw(10) << summary.count << std::setw(12) << summary.p50 << std::setw(12) << summary.p95
+                << std::setw(12) << summary.p99 << std::setw(12) << summary.max << "\n";
+    }
+    aStream.unsetf(std::ios_base::floatfield);
+}
+
+bool
+Trace::writeChromeTrace(const std::string& aFilepath) {
+    std::ofstream file(aFilepath);
+    if(!file)
+        return false;
+
+    file << std::fixed << std::setprecision(3);
+    file << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+    bool first = true;
+
+    Registry& registry = pRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for(const auto& recorder : registry.recorders) {
+        file << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+             << recorder->threadIndex << ", \"args\": {\"name\": \"thread " << recorder->threadIndex << "\"}}";
+        first = false;
+
+        const uint64_t eventCount = recorder->eventCount.load(std::memory_order_acquire);
+        const uint64_t firstEvent = eventCount > EVENT_CAPACITY ? eventCount - EVENT_CAPACITY : 0;
+        for(uint64_t eventIndex = firstEvent; eventIndex < eventCount; ++eventIndex) {
+            const Event& event = recorder->events[eventIndex % EVENT_CAPACITY];
+            const uint64_t durationAndStage = event.durationAndStage.load(std::memory_order_relaxed);
+            // Timestamps are in microseconds.
+            file << ",\n{\"name\": \"" << stageName(static_cast<Stage>(durationAndStage & 0xff))
+                 << "\", \"cat\": \"recognition\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << recorder->threadIndex
+                 << ", \"ts\": " << event.start.load(std::memory_order_relaxed) / 1000.0
+                 << ", \"dur\": " << (durationAndStage >> 8) / 1000.0 << "}";
+        }
+    }
+    file << "\n]}\n";
+    return static_cast<bool>(file);
+}
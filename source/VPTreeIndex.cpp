@@ -0,0 +1,311 @@
+#include "VPTreeIndex.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <numeric>
+
+#include <QString>
+
+#include "BinaryKNN.hpp"
+#include "Log.hpp"
+
+namespace {
+    constexpr char INDEX_MAGIC[8] = {'J', 'P', 'V', 'P', 'T', 'R', 'E', 'E'};
+    constexpr uint32_t INDEX_VERSION = 1;
+
+    // Written in host byte order. The index is rebuilt per machine anyway.
+    struct IndexFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t sampleCount;
+        uint32_t leafSize;
+        uint32_t nodeCount;
+        uint32_t itemCount;
+        // See setSearchBudget(). Zero in indices written before it was stored.
+        uint32_t searchBudget;
+    };
+
+    uint32_t
+    pDistance(const uint8_t* aFirst, const uint8_t* aSecond) {
+        uint32_t distance = 0;
+        BinaryFeatures::hammingDistances(aFirst, aSecond, 1, &distance);
+        return distance;
+    }
+
+    // Insert aCandidate into the sorted neighbour list, keeping at most aK entries.
+    void
+    pConsider(std::vector<VPTreeIndex::Neighbour>& aNeighbours, int aK, const VPTreeIndex::Neighbour& aCandidate) {
+        if(static_cast<int>(aNeighbours.size()) == aK && !(aCandidate < aNeighbours.back()))
+            return;
+        aNeighbours.insert(std::upper_bound(aNeighbours.begin(), aNeighbours.end(), aCandidate), aCandidate);
+        if(static_cast<int>(aNeighbours.size()) > aK)
+            aNeighbours.pop_back();
+    }
+}
+
+cv::Ptr<VPTreeIndex>
+VPTreeIndex::build(const cv::Mat& aPackedSamples, int aLeafSize, uint32_t aSeed) {
+    CV_Assert(aPackedSamples.cols == FEATURE_ROW_STRIDE && aPackedSamples.type() == CV_8U && aLeafSize > 0);
+
+    auto index = cv::makePtr<VPTreeIndex>();
+    index->mSampleCount = aPackedSamples.rows;
+    index->mLeafSize = aLeafSize;
+    index->mItems.resize(aPackedSamples.rows);
+    std::iota(index->mItems.begin(), index->mItems.end(), 0);
+    index->mNodes.reserve(2 * (aPackedSamples.rows / aLeafSize + 1));
+
+    std::vector<uint32_t> scratch(aPackedSamples.rows);
+    uint32_t randomState = aSeed ? aSeed : 1u;
+    index->pBuildNode(aPackedSamples, 0, aPackedSamples.rows, scratch, randomState);
+    return index;
+}
+
+int32_t
+VPTreeIndex::pBuildNode(const cv::Mat& aPackedSamples, int aBegin, int aEnd, std::vector<uint32_t>& aScratch,
+                        uint32_t& aRandomState) {
+    if(aBegin >= aEnd)
+        return -1;
+
+    const auto nodeIndex = static_cast<int32_t>(mNodes.size());
+    mNodes.push_back(Node{-1, 0, aBegin, aEnd - aBegin});
+    if(aEnd - aBegin <= mLeafSize)
+        return nodeIndex;
+
+    // xorshift32, only needs to be cheap and reproducible.
+    aRandomState ^= aRandomState << 13;
+    aRandomState ^= aRandomState >> 17;
+    aRandomState ^= aRandomState << 5;
+    std::swap(mItems[aBegin], mItems[aBegin + static_cast<int>(aRandomState % static_cast<uint32_t>(aEnd - aBegin))]);
+
+    const int32_t vantage = mItems[aBegin];
+    const uint8_t* vantageRow = aPackedSamples.ptr<uint8_t>(vantage);
+    for(int position = aBegin + 1; position < aEnd; ++position)
+        aScratch[mItems[position]] = pDistance(vantageRow, aPackedSamples.ptr<uint8_t>(mItems[position]));
+
+    // Split at the median distance. Every sample at a distance <= radius goes inside,
+    // so samples equal to the median never end up on both sides.
+    auto first = mItems.begin() + aBegin + 1;
+    auto last = mItems.begin() + aEnd;
+    auto median = first + (last - first) / 2;
+    auto byDistance = [&aScratch](int32_t aLeft, int32_t aRight) { return aScratch[aLeft] < aScratch[aRight]; };
+    std::nth_element(first, median, last, byDistance);
+    uint32_t radius = aScratch[*median];
+    auto split = std::partition(first, last, [&aScratch, radius](int32_t aItem) { return aScratch[aItem] <= radius; });
+
+    // Ties at the largest distance, e.g. duplicate samples, would all go inside and leave the
+    // outside empty, peeling a single sample per level. They go outside instead. If every
+    // sample is at the same distance nothing separates them and the node stays a leaf.
+    if(split == last) {
+        if(radius == 0)
+            return nodeIndex;
+        split = std::partition(first, last, [&aScratch, radius](int32_t aItem) { return aScratch[aItem] < radius; });
+        if(split == first)
+            return nodeIndex;
+        --radius;
+    }
+    const int splitPosition = static_cast<int>(split - mItems.begin());
+
+    const int32_t inside = pBuildNode(aPackedSamples, aBegin + 1, splitPosition, aScratch, aRandomState);
+    const int32_t outside = pBuildNode(aPackedSamples, splitPosition, aEnd, aScratch, aRandomState);
+    mNodes[nodeIndex] = Node{vantage, radius, inside, outside};
+    return nodeIndex;
+}
+
+cv::Ptr<VPTreeIndex>
+VPTreeIndex::load(const std::string& aFilepath) {
+    auto index = cv::makePtr<VPTreeIndex>();
+    std::ifstream file(aFilepath, std::ios::binary);
+    if(!file.is_open())
+        return index;
+
+    IndexFileHeader header;
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if(!file || std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header.version != INDEX_VERSION
+        || header.itemCount != header.sampleCount || header.leafSize == 0) {
+        LOG(level::warning, "VPTreeIndex::load()", QString::fromStdString(aFilepath) + " is not a valid index.");
+        return index;
+    }
+
+    // Every node holds at least one sample, its vantage point or a leaf item. The size is
+    // checked against the file before anything is allocated.
+    const uint64_t expectedSize = sizeof(header) + static_cast<uint64_t>(header.nodeCount) * sizeof(Node)
+        + static_cast<uint64_t>(header.itemCount) * sizeof(int32_t);
+    file.seekg(0, std::ios::end);
+    if(header.sampleCount > static_cast<uint32_t>(INT32_MAX) || header.nodeCount > std::max(header.sampleCount, 1u)
+        || static_cast<uint64_t>(file.tellg()) != expectedSize) {
+        LOG(level::warning, "VPTreeIndex::load()", QString::fromStdString(aFilepath) + " is truncated or corrupted.");
+        return index;
+    }
+    file.seekg(sizeof(header));
+
+    std::vector<Node> nodes(header.nodeCount);
+    std::vector<int32_t> items(header.itemCount);
+    file.read(reinterpret_cast<char*>(nodes.data()), nodes.size() * sizeof(Node));
+    file.read(reinterpret_cast<char*>(items.data()), items.size() * sizeof(int32_t));
+    if(!file) {
+        LOG(level::warning, "VPTreeIndex::load()", QString::fromStdString(aFilepath) + " is truncated.");
+        return index;
+    }
+
+    // search() follows the nodes without any check. Children are written after their parent,
+    // which also rules out cycles.
+    const int64_t sampleCount = header.sampleCount;
+    const int64_t nodeCount = header.nodeCount;
+    auto isValidChild = [nodeCount](int64_t aParent, int32_t aChild) {
+        return aChild == -1 || (aChild > aParent && aChild < nodeCount);
+    };
+    for(int64_t node = 0; node < nodeCount; ++node) {
+        const Node& current = nodes[node];
+        const bool valid = current.vantage == -1
+            ? current.inside >= 0 && current.outside >= 0
+                && static_cast<int64_t>(current.inside) + current.outside <= sampleCount
+            : current.vantage >= 0 && current.vantage < sampleCount
+                && isValidChild(node, current.inside) && isValidChild(node, current.outside);
+        if(!valid) {
+            LOG(level::warning, "VPTreeIndex::load()", QString::fromStdString(aFilepath) + " has an invalid node.");
+            return index;
+        }
+    }
+    if(std::any_of(items.begin(), items.end(), [sampleCount](int32_t aItem) { return aItem < 0 || aItem >= sampleCount; })) {
+        LOG(level::warning, "VPTreeIndex::load()", QString::fromStdString(aFilepath) + " has an invalid sample.");
+        return index;
+    }
+
+    index->mNodes = std::move(nodes);
+    index->mItems = std::move(items);
+    index->mSampleCount = static_cast<int>(header.sampleCount);
+    index->mLeafSize = static_cast<int>(header.leafSize);
+    index->setSearchBudget(static_cast<int>(header.searchBudget));
+    return index;
+}
+
+bool
+VPTreeIndex::save(const std::string& aFilepath) const {
+    std::ofstream file(aFilepath, std::ios::binary | std::ios::trunc);
+    if(!file.is_open())
+        return false;
+
+    IndexFileHeader header{};
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.sampleCount = static_cast<uint32_t>(mSampleCount);
+    header.leafSize = static_cast<uint32_t>(mLeafSize);
+    header.nodeCount = static_cast<uint32_t>(mNodes.size());
+    header.itemCount = static_cast<uint32_t>(mItems.size());
+    header.searchBudget = static_cast<uint32_t>(mSearchBudget);
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(mNodes.data()), mNodes.size() * sizeof(Node));
+    file.write(reinterpret_cast<const char*>(mItems.data()), mItems.size() * sizeof(int32_t));
+    return static_cast<bool>(file);
+}
+
+void
+VPTreeIndex::search(const cv::Mat& aPackedSamples, const uint8_t* aQuery, int aK,
+                    std::vector<Neighbour>& aNeighbours) const {
+    aNeighbours.clear();
+    if(empty() || aK <= 0)
+        return;
+
+    // Nodes still to visit, ordered by the lower bound of the distance to anything inside them.
+    using Pending = std::pair<uint32_t, int32_t>;
+    std::vector<Pending> pending;
+    pending.emplace_back(0, 0);
+
+    auto worstDistance = [&aNeighbours, aK]() {
+        return static_cast<int>(aNeighbours.size()) < aK ? UINT32_MAX : aNeighbours.back().first;
+    };
+    auto visit = [&pending, &worstDistance](uint32_t aBound, int32_t aNode) {
+        if(aNode < 0 || aBound > worstDistance())
+            return;
+        pending.emplace_back(aBound, aNode);
+        std::push_heap(pending.begin(), pending.end(), std::greater<Pending>());
+    };
+
+    int evaluations = 0;
+    while(!pending.empty()) {
+        std::pop_heap(pending.begin(), pending.end(), std::greater<Pending>());
+        const Pending next = pending.back();
+        pending.pop_back();
+
+        // Bounds only grow from here on. Nodes at exactly the worst distance are still
+        // visited so ties resolve toward the smaller sample index, like the brute force search.
+        if(next.first > worstDistance())
+            break;
+        // The budget never cuts a search short before aK neighbours were found.
+        if(mSearchBudget > 0 && evaluations >= mSearchBudget && static_cast<int>(aNeighbours.size()) >= aK)
+            break;
+
+        const Node& node = mNodes[next.second];
+        if(node.vantage < 0) {
+            for(int position = node.inside; position < node.inside + node.outside; ++position) {
+                const int32_t item = mItems[position];
+                pConsider(aNeighbours, aK, {pDistance(aQuery, aPackedSamples.ptr<uint8_t>(item)), item});
+            }
+            evaluations += node.outside;
+            continue;
+        }
+
+        const uint32_t distance = pDistance(aQuery, aPackedSamples.ptr<uint8_t>(node.vantage));
+        ++evaluations;
+        pConsider(aNeighbours, aK, {distance, node.vantage});
+
+        // Triangle inequality: inside samples are at least distance - radius away,
+        // outside samples at least radius + 1 - distance.
+        visit(distance > node.radius ? distance - node.radius : 0, node.inside);
+        visit(node.radius + 1 > distance ? node.radius + 1 - distance : 0, node.outside);
+    }
+}
+
+void
+VPTreeIndex::setSearchBudget(int aMaxDistanceEvaluations) {
+    mSearchBudget = std::max(0, aMaxDistanceEvaluations);
+}
+
+int
+VPTreeIndex::getSearchBudget() const {
+    return mSearchBudget;
+}
+
+double
+VPTreeIndex::measureRecall(const cv::Mat& aPackedSamples, const cv::Mat& aPackedQueries, int aK) const {
+    if(empty() || aPackedQueries.empty() || aK <= 0)
+        return 0.0;
+
+    std::vector<uint32_t> distances(aPackedSamples.rows);
+    std::vector<Neighbour> exact, approximate;
+    size_t expected = 0, found = 0;
+
+    for(int query = 0; query < aPackedQueries.rows; ++query) {
+        const uint8_t* queryRow = aPackedQueries.ptr<uint8_t>(query);
+        BinaryFeatures::hammingDistances(queryRow, aPackedSamples.ptr<uint8_t>(0), distances.size(), distances.data());
+
+        exact.clear();
+        for(int sample = 0; sample < aPackedSamples.rows; ++sample)
+            pConsider(exact, aK, {distances[sample], sample});
+
+        search(aPackedSamples, queryRow, aK, approximate);
+
+        expected += exact.size();
+        for(const auto& neighbour : exact)
+            for(const auto& candidate : approximate)
+                if(candidate.second == neighbour.second) {
+                    ++found;
+                    break;
+                }
+    }
+
+    return expected ? static_cast<double>(found) / static_cast<double>(expected) : 0.0;
+}
+
+int
+VPTreeIndex::getSampleCount() const {
+    return mSampleCount;
+}
+
+bool
+VPTreeIndex::empty() const {
+    return mNodes.empty();
+}
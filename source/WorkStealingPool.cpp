@@ -0,0 +1,183 @@
+#include "WorkStealingPool.hpp"
+
+#include <algorithm>
+
+namespace {
+    // Index of the worker running on this thread.
+    thread_local int tWorkerIndex = -1;
+
+    // Pool the worker running on this thread belongs to.
+    thread_local const WorkStealingPool* tWorkerPool = nullptr;
+}
+
+WorkStealingPool::WorkStealingPool(unsigned aThreadCount)
+    : mQueued(0),
+      mPending(0),
+      mNextQueue(0),
+      mStopping(false)
+{
+    if(aThreadCount == 0)
+        aThreadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    mQueues.reserve(aThreadCount);
+    for(unsigned index = 0; index < aThreadCount; ++index)
+        mQueues.push_back(std::make_unique<Queue>());
+
+    mThreads.reserve(aThreadCount);
+    for(unsigned index = 0; index < aThreadCount; ++index)
+        mThreads.emplace_back(&WorkStealingPool::pRun, this, index);
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mAllDone.wait(lock, [this]() { return mPending.load() == 0; });
+        mStopping = true;
+    }
+    mWorkAvailable.notify_all();
+    for(auto& thread : mThreads)
+        thread.join();
+}
+
+void
+WorkStealingPool::submit(std::function<void()> aTask) {
+    unsigned index = tWorkerPool == this
+        ? static_cast<unsigned>(tWorkerIndex)
+        : mNextQueue.fetch_add(1) % static_cast<unsigned>(mQueues.size());
+
+    ++mPending;
+    {
+        std::lock_guard<std::mutex> lock(mQueues[index]->mutex);
+        mQueues[index]->tasks.push_back(std::move(aTask));
+    }
+    ++mQueued;
+    // Taking the lock orders the wake up after a worker checking for work goes to sleep.
+    { std::lock_guard<std::mutex> lock(mMutex); }
+    mWorkAvailable.notify_one();
+}
+
+void
+WorkStealingPool::wait() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mAllDone.wait(lock, [this]() { return mPending.load() == 0; });
+    if(mException) {
+        auto exception = mException;
+        mException = nullptr;
+        std::rethrow_exception(exception);
+    }
+}
+
+void
+WorkStealingPool::parallelFor(size_t aCount, const std::function<void(size_t)>& aBody) {
+    if(aCount == 0)
+        return;
+
+    // Outlives the call, helpers may only start once every index is done.
+    struct Group {
+        std::atomic<size_t> next{0};
+        size_t done = 0;
+        std::mutex mutex;
+        std::condition_variable allDone;
+        std::exception_ptr exception;
+    };
+    auto group = std::make_shared<Group>();
+
+    // Claims indices until none is left. aBody is only used while an index
+    // is unfinished, so while the caller still waits.
+    auto work = [group, &aBody, aCount]() {
+        size_t index;
+        while((index = group->next.fetch_add(1)) < aCount) {
+            std::exception_ptr exception;
+            try {
+                aBody(index);
+            } catch(...) {
+                exception = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(group->mutex);
+            if(exception && !group->exception)
+                group->exception = exception;
+            if(++group->done == aCount)
+                group->allDone.notify_all();
+        }
+    };
+
+    const size_t helpers = std::min(aCount - 1, mThreads.size());
+    for(size_t helper = 0; helper < helpers; ++helper)
+        submit(work);
+    work();
+
+    // Every index is claimed, the unfinished ones are running on other threads.
+    std::unique_lock<std::mutex> lock(group->mutex);
+    group->allDone.wait(lock, [&group, aCount]() { return group->done == aCount; });
+    if(group->exception)
+        std::rethrow_exception(group->exception);
+}
+
+WorkStealingPool&
+WorkStealingPool::getShared() {
+    static WorkStealingPool pool;
+    return pool;
+}
+
+unsigned
+WorkStealingPool::getThreadCount() const {
+    return static_cast<unsigned>(mThreads.size());
+}
+
+int
+WorkStealingPool::currentWorker() {
+    return tWorkerIndex;
+}
+
+void
+WorkStealingPool::pRun(unsigned aIndex) {
+    tWorkerIndex = static_cast<int>(aIndex);
+    tWorkerPool = this;
+
+    std::function<void()> task;
+    while(true) {
+        if(pTake(aIndex, task)) {
+            try {
+                task();
+            } catch(...) {
+                std::lock_guard<std::mutex> lock(mMutex);
+                if(!mException)
+                    mException = std::current_exception();
+            }
+            task = nullptr;
+            if(--mPending == 0) {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mAllDone.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWorkAvailable.wait(lock, [this]() { return mStopping || mQueued.load() > 0; });
+        if(mStopping && mQueued.load() == 0)
+            return;
+    }
+}
+
+bool
+WorkStealingPool::pTake(unsigned aIndex, std::function<void()>& aTask) {
+    const unsigned count = static_cast<unsigned>(mQueues.size());
+    for(unsigned offset = 0; offset < count; ++offset) {
+        Queue& queue = *mQueues[(aIndex + offset) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.tasks.empty())
+            continue;
+        // Own tasks newest first, they are the most likely to be in cache.
+        // Stolen tasks oldest first, they are the furthest from what the owner works on.
+        if(offset == 0) {
+            aTask = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            aTask = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        --mQueued;
+        return true;
+    }
+    return false;
+}
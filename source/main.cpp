@@ -11,6 +11,9 @@
 
 int main(int argc, char *argv[])
 {
+    // DrawArea batches pointer samples per frame itself, Qt must
+    // deliver all of them instead of merging mouse moves.
+    QApplication::setAttribute(Qt::AA_CompressHighFrequencyEvents, false);
     QApplication a(argc, argv);
     MainWindow w;
     w.show();
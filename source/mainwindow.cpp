@@ -2,6 +2,7 @@
 #include "ui_mainwindow.h"
 
 #include "DrawArea.hpp"
+#include "Trace.hpp"
 
 #include <QMouseEvent>
 #include <QPixmap>
@@ -9,14 +10,24 @@
 // Test
 #include <QListWidget>
 #include <QPushButton>
+#include <QCheckBox>
 #include <QLabel>
+#include <QHBoxLayout>
+#include <QIcon>
+#include <QToolButton>
+
+#include <sstream>
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , mUi(new Ui::MainWindow),
     mDrawArea(nullptr),
     mPredictionArea(nullptr),
+    mConfidenceLabel(nullptr),
+    mAlternativesArea(nullptr),
+    mAlternativesFingerprint(0),
     mCompareButton(nullptr),
+    mLiveCheckBox(nullptr),
     mCtrlKey_modifier(false)
 {
     mUi->setupUi(this);
@@ -36,14 +47,56 @@ MainWindow::MainWindow(QWidget *parent)
     mPredictionArea->resize(QSize(384, 384));
     mUi->gridLayout->addWidget(mPredictionArea, 0, 1, 1, 1);
 
+    mConfidenceLabel = new QLabel(mUi->centralwidget);
+    mConfidenceLabel->setObjectName("ConfidenceLabel");
+    mUi->gridLayout->addWidget(mConfidenceLabel, 1, 1, 1, 1);
+
+    mAlternativesArea = new QWidget(mUi->centralwidget);
+    mAlternativesArea->setObjectName("AlternativesArea");
+    QHBoxLayout* alternativesLayout = new QHBoxLayout(mAlternativesArea);
+    alternativesLayout->setContentsMargins(0, 0, 0, 0);
+    for (int alternative = 0; alternative < ALTERNATIVE_COUNT; ++alternative) {
+        QToolButton* alternativeButton = new QToolButton(mAlternativesArea);
+        alternativeButton->setFixedSize(ALTERNATIVE_SIZE, ALTERNATIVE_SIZE);
+        alternativeButton->setIconSize(QSize(ALTERNATIVE_SIZE, ALTERNATIVE_SIZE));
+        alternativeButton->setAutoRaise(true);
+        alternativeButton->setEnabled(false);
+        alternativesLayout->addWidget(alternativeButton);
+        mAlternativeButtons.push_back(alternativeButton);
+        mAlternativeCandidates.push_back(-1);
+        // Clicking a runner up tells the model the drawing was that character.
+        QObject::connect(alternativeButton, &QToolButton::clicked, this, [this, alternative]() {
+            if (mAlternativeCandidates[alternative] >= 0)
+                mDrawArea->learnDrawing(mAlternativeCandidates[alternative], mAlternativesFingerprint);
+        });
+    }
+    alternativesLayout->addStretch();
+    mUi->gridLayout->addWidget(mAlternativesArea, 2, 1, 1, 1);
+
     mCompareButton = new QPushButton(mUi->centralwidget);
     mCompareButton->setObjectName("CompareLayerButton");
     mCompareButton->setText("Compare Layer");
-    mCompareButton->setEnabled(true);
+    // The model is loaded in the background, comparing is only possible once it is ready.
+    mCompareButton->setEnabled(mDrawArea->isModelReady());
     mUi->gridLayout->addWidget(mCompareButton, 4, 0, 1, 1);
 
+    mLiveCheckBox = new QCheckBox(mUi->centralwidget);
+    mLiveCheckBox->setObjectName("LiveRecognitionCheckBox");
+    mLiveCheckBox->setText("Live Recognition");
+    mUi->gridLayout->addWidget(mLiveCheckBox, 4, 1, 1, 1);
+
     QObject::connect(mCompareButton, SIGNAL(clicked(bool)),
                      this, SLOT(compareLayer(bool)));
+    QObject::connect(mDrawArea, SIGNAL(modelReady(bool)),
+                     mCompareButton, SLOT(setEnabled(bool)));
+    QObject::connect(mDrawArea, SIGNAL(layerCompared(int)),
+                     this, SLOT(showPrediction(int)));
+    QObject::connect(mDrawArea, &DrawArea::layerRecognized,
+                     this, &MainWindow::showAlternatives);
+    QObject::connect(mDrawArea, &DrawArea::drawingChanged,
+                     this, &MainWindow::disableAlternatives);
+    QObject::connect(mLiveCheckBox, SIGNAL(toggled(bool)),
+                     mDrawArea, SLOT(setLiveRecognition(bool)));
 
     this->adjustSize();
     this->setWindowFlags(Qt::MSWindowsFixedSizeDialogHint);
@@ -54,17 +107,70 @@ MainWindow::~MainWindow()
     delete mUi;
     delete mDrawArea;
     delete mCompareButton;
+    delete mLiveCheckBox;
+    delete mConfidenceLabel;
+    delete mAlternativesArea;
 }
 
 void
 MainWindow::compareLayer(bool) {
     //LOG("Now comparing layers");
     LOG(level::info, "MainWindow::CompareLayer()", "Now comparing layers");
-    int loadIndex = mDrawArea->compareLayer();
-    QImage loadImage = mDrawArea->getResourceCharacterImage(loadIndex);
+    mDrawArea->compareLayer();
+}
+
+void
+MainWindow::showPrediction(int aLabel) {
+    // Nothing drawn anymore, e.g. after undoing every stroke.
+    if (aLabel < 0) {
+        mPredictionArea->clear();
+        return;
+    }
+    QImage loadImage = mDrawArea->getResourceCharacterImage(aLabel);
     mPredictionArea->setPixmap(QPixmap::fromImage(loadImage));
 }
 
+void
+MainWindow::showAlternatives(const RecognitionResult& aResult) {
+    if (aResult.label < 0)
+        mConfidenceLabel->clear();
+    else
+        mConfidenceLabel->setText(QString("Confidence: %1%").arg(qRound(aResult.confidence * 100.0f)));
+    mAlternativesFingerprint = aResult.fingerprint;
+
+    // The first candidate is the prediction itself. An empty result has none,
+    // every runner up is cleared.
+    for (size_t alternative = 0; alternative < mAlternativeButtons.size(); ++alternative) {
+        QToolButton* alternativeButton = mAlternativeButtons[alternative];
+        mAlternativeCandidates[alternative] = -1;
+        alternativeButton->setIcon(QIcon());
+        alternativeButton->setToolTip(QString());
+        alternativeButton->setEnabled(false);
+        if (alternative + 1 >= aResult.candidates.size())
+            continue;
+
+        const RecognitionResult::Candidate& candidate = aResult.candidates[alternative + 1];
+        QImage image = mDrawArea->getResourceCharacterImage(candidate.label);
+        if (image.isNull())
+            continue;
+        mAlternativeCandidates[alternative] = candidate.label;
+        alternativeButton->setIcon(QIcon(QPixmap::fromImage(image.scaled(ALTERNATIVE_SIZE, ALTERNATIVE_SIZE,
+                                                                         Qt::KeepAspectRatio,
+                                                                         Qt::SmoothTransformation))));
+        alternativeButton->setToolTip(QString("%1 of %2 scales, distance %3. Click if this is what you drew.")
+                                      .arg(candidate.votes).arg(aResult.distances.size()).arg(candidate.distance));
+        alternativeButton->setEnabled(true);
+    }
+}
+
+void
+MainWindow::disableAlternatives() {
+    for (size_t alternative = 0; alternative < mAlternativeButtons.size(); ++alternative) {
+        mAlternativeCandidates[alternative] = -1;
+        mAlternativeButtons[alternative]->setEnabled(false);
+    }
+}
+
 void
 MainWindow::keyPressEvent(QKeyEvent* event) {
     LOG(level::info, "MainWindow::KeyPressEvent()", "Handling key press event.");
@@ -79,15 +185,51 @@ MainWindow::keyPressEvent(QKeyEvent* event) {
             // Make sure user is pressing ctrl and that the draw area is
             // not null
             if (mCtrlKey_modifier && mDrawArea) {
-                LOG(level::info, "MainWindow::KeyPressEvent()", "Performing undo operation.");
-                mDrawArea->undoLayer();
+                // ctrl-shift-z is the usual alternative to ctrl-y.
+                if (event->modifiers() & Qt::ShiftModifier) {
+                    LOG(level::info, "MainWindow::KeyPressEvent()", "Performing redo operation.");
+                    mDrawArea->redoLayer();
+                } else {
+                    LOG(level::info, "MainWindow::KeyPressEvent()", "Performing undo operation.");
+                    mDrawArea->undoLayer();
+                }
             }
             break;
+        case Qt::Key_Y:
+            LOG(level::info, "MainWindow::KeyPressEvent()",
+                                          "Y key pressed.");
+            if (mCtrlKey_modifier && mDrawArea) {
+                LOG(level::info, "MainWindow::KeyPressEvent()", "Performing redo operation.");
+                mDrawArea->redoLayer();
+            }
+            break;
+        case Qt::Key_T:
+            LOG(level::info, "MainWindow::KeyPressEvent()",
+                                          "T key pressed.");
+            if (mCtrlKey_modifier)
+                dumpTrace();
+            break;
         default:
             break;
     };
 }
 
+void
+MainWindow::dumpTrace() {
+    std::ostringstream summary;
+    Trace::dumpSummary(summary);
+    std::istringstream lines(summary.str());
+    for (std::string line; std::getline(lines, line);)
+        LOG(level::standard, "MainWindow::dumpTrace()", QString::fromStdString(line));
+
+    const RecognitionCache& cache = mDrawArea->getRecognitionCache();
+    LOG(level::standard, "MainWindow::dumpTrace()", "Recognition cache [ HITS : MISSES ] -> [ "
+        + QString::number(cache.getHits()) + " : " + QString::number(cache.getMisses()) + " ]");
+
+    if (!Trace::writeChromeTrace(TRACE_OUTPUT_FILE))
+        LOG(level::error, "MainWindow::dumpTrace()", QString("Unable to write ") + TRACE_OUTPUT_FILE);
+}
+
 void
 MainWindow::keyReleaseEvent(QKeyEvent* event) {
     LOG(level::info, "MainWindow::keyPressEvent()", "Handling key release event.");
@@ -0,0 +1,241 @@
+#include "BinaryKNN.hpp"
+#include "ImageProcessMethods.hpp"
+#include "ModelFile.hpp"
+#include "Trace.hpp"
+#include "VPTreeIndex.hpp"
+#include "WorkStealingPool.hpp"
+
+#include "opencv2/imgcodecs.hpp"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QString>
+#include <QStringList>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+* Headless batch recognition of character images.
+*
+* Usage: BATCH_RECOGNIZE [--model <model.jpknn|model.opknn>] [--threads <count>] [--trace <trace.json>]
+*                        <directory|image.png>...
+*
+* Every PNG of the given directories and every given image is recognized on a work
+* stealing pool, one image per task. A CSV row is streamed to stdout as soon as an
+* image is done, so rows come out in completion order:
+*
+*   filename,label,distance,latency
+*
+* distance is the distance to the nearest reference sample among the scales voting for the
+* label (in bits), latency the time spent on the image from decoding to voting (in microseconds).
+* Images where no character is found get the label -1, so do images that cannot be decoded.
+* Their error is printed to stderr.
+*
+* Images can be light characters on a dark background, like the testing images, or dark
+* characters on a light background, like scans. They are binarized with Otsu's threshold.
+*
+* With --trace, the latency percentiles of every stage are printed once done and the spans
+* are written as a Chrome trace. Needs a build with ENABLE_TRACING.
+*/
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+namespace {
+    struct Recognition {
+        int label;
+        uint32_t distance;
+    };
+
+    std::string
+    pDefaultIndexPath(const std::string& aModelPath) {
+        auto extension = aModelPath.find_last_of('.');
+        auto separator = aModelPath.find_last_of("/\\");
+        if(extension == std::string::npos || (separator != std::string::npos && extension < separator))
+            return aModelPath + ".vpt";
+        return aModelPath.substr(0, extension) + ".vpt";
+    }
+
+    cv::Ptr<BinaryKNearest>
+    pLoadModel(const std::string& aModelPath) {
+        cv::Ptr<BinaryKNearest> model = QFileInfo(QString::fromStdString(aModelPath)).suffix() == "jpknn"
+            ? ModelFile::load(aModelPath)
+            : BinaryKNearest::load(aModelPath);
+        if(model->empty())
+            return model;
+
+        auto index = VPTreeIndex::load(pDefaultIndexPath(aModelPath));
+        if(!index->empty())
+            model->setIndex(index);
+        return model;
+    }
+
+    std::vector<std::string>
+    pCollectImages(const std::vector<std::string>& aInputs) {
+        std::vector<std::string> images;
+        for(const auto& input : aInputs) {
+            QFileInfo info(QString::fromStdString(input));
+            if(!info.isDir()) {
+                images.push_back(input);
+                continue;
+            }
+            QDir directory(info.filePath());
+            for(const auto& image : directory.entryList(QStringList() << "*.png" << "*.PNG", QDir::Files, QDir::Name))
+                images.push_back(directory.filePath(image).toStdString());
+        }
+        return images;
+    }
+
+    Recognition
+    pRecognize(const BinaryKNearest& aModel, const std::string& aFilepath) {
+        TRACE_SPAN(Recognition);
+        cv::Mat image;
+        {
+            TRACE_SPAN(Readback);
+            image = cv::imread(aFilepath, cv::IMREAD_GRAYSCALE);
+            if(image.empty() || image.cols < 3 || image.rows < 3)
+                return {-1, 0};
+            ImageMethods::binarizeCharacter(image);
+        }
+
+        cv::Rect roi;
+        {
+            TRACE_SPAN(ROIExtraction);
+            roi = ImageMethods::obtainROI(image);
+        }
+        if(roi.empty())
+            return {-1, 0};
+
+        // Every worker keeps its own buffers between images.
+        thread_local ImageMethods::FeatureWorkspace workspace;
+        cv::Mat features;
+        {
+            TRACE_SPAN(Rescaling);
+            features = TechniqueMethods::ROIRescalingFeatures(image, roi, workspace);
+        }
+        if(features.empty())
+            return {-1, 0};
+
+        cv::Mat results, distances;
+        {
+            TRACE_SPAN(KNNSearch);
+            aModel.findNearest(features, KNN_NEIGHBOURS, results, cv::noArray(), distances);
+        }
+
+        TRACE_SPAN(Voting);
+        std::vector<int> labels(results.rows);
+        for(int row = 0; row < results.rows; ++row)
+            labels[row] = static_cast<int>(results.at<float>(row));
+        Recognition recognition{ImageMethods::findMostFrequentLabel(labels), std::numeric_limits<uint32_t>::max()};
+        for(int row = 0; row < results.rows; ++row)
+            if(labels[row] == recognition.label)
+                recognition.distance = std::min(recognition.distance, static_cast<uint32_t>(distances.at<float>(row, 0)));
+        return recognition;
+    }
+
+    // Quote a CSV field if needed.
+    std::string
+    pCsvField(const std::string& aField) {
+        if(aField.find_first_of(",\"\n") == std::string::npos)
+            return aField;
+        std::string quoted = "\"";
+        for(char character : aField) {
+            if(character == '"')
+                quoted += '"';
+            quoted += character;
+        }
+        return quoted + "\"";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string modelPath = "../resource/kNN_ETL_Subset.jpknn";
+    bool modelGiven = false;
+    unsigned threadCount = 0;
+    std::string tracePath;
+    std::vector<std::string> inputs;
+    for(int arg = 1; arg < argc; ++arg) {
+        if(std::strcmp(argv[arg], "--model") == 0 && arg + 1 < argc) {
+            modelPath = argv[++arg];
+            modelGiven = true;
+        } else if(std::strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            threadCount = static_cast<unsigned>(std::max(0, std::atoi(argv[++arg])));
+        } else if(std::strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc) {
+            tracePath = argv[++arg];
+        } else if(std::strncmp(argv[arg], "--", 2) == 0) {
+            std::cerr << "Unknown argument: " << argv[arg] << "\n";
+            return 1;
+        } else {
+            inputs.push_back(argv[arg]);
+        }
+    }
+    if(inputs.empty()) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--model <model.jpknn|model.opknn>] [--threads <count>] [--trace <trace.json>]"
+                  << " <directory|image.png>...\n";
+        return 1;
+    }
+
+    cv::Ptr<BinaryKNearest> model = pLoadModel(modelPath);
+    // Same fallback as the application, the OpenCV model is parsed if it was never converted.
+    if(model->empty() && !modelGiven)
+        model = pLoadModel("../resource/kNN_ETL_Subset.opknn");
+    if(model->empty()) {
+        std::cerr << "Unable to load a model from " << modelPath << "\n";
+        return 1;
+    }
+
+    std::vector<std::string> images = pCollectImages(inputs);
+    WorkStealingPool pool(threadCount);
+    std::cerr << "Recognizing " << images.size() << " images on " << pool.getThreadCount() << " threads ("
+              << BinaryFeatures::kernelName() << " kernel)\n";
+
+    std::mutex outputMutex;
+    std::cout << "filename,label,distance,latency\n";
+
+    auto startTime = steady_clock::now();
+    for(const auto& image : images) {
+        pool.submit([&model, &outputMutex, image]() {
+            auto imageStart = steady_clock::now();
+            // A corrupt or unsupported image gets a -1 row, the rest of the batch goes on.
+            Recognition recognition{-1, 0};
+            std::string error;
+            try {
+                recognition = pRecognize(*model, image);
+            } catch(const cv::Exception& ex) {
+                error = ex.what();
+            }
+            duration<double, std::micro> latency = steady_clock::now() - imageStart;
+
+            std::lock_guard<std::mutex> lock(outputMutex);
+            if(!error.empty())
+                std::cerr << image << ": " << error << "\n";
+            std::cout << pCsvField(image) << "," << recognition.label << ",";
+            if(recognition.label >= 0)
+                std::cout << recognition.distance;
+            std::cout << "," << static_cast<long long>(latency.count()) << std::endl;
+        });
+    }
+    pool.wait();
+    duration<double> elapsed = steady_clock::now() - startTime;
+
+    std::cerr << "TOTAL [ IMAGES : TIME (s) : THROUGHPUT (images/s) ] -> [ " << images.size() << " : "
+              << elapsed.count() << " : " << (elapsed.count() > 0.0 ? images.size() / elapsed.count() : 0.0) << " ]\n";
+
+    if(!tracePath.empty()) {
+        Trace::dumpSummary(std::cerr);
+        if(!Trace::writeChromeTrace(tracePath)) {
+            std::cerr << "Unable to write " << tracePath << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
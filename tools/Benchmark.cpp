@@ -0,0 +1,451 @@
+#include "BinaryKNN.hpp"
+#include "ImageProcessMethods.hpp"
+#include "ModelFile.hpp"
+
+#include "opencv2/core/utility.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <QDir>
+#include <QImage>
+#include <QString>
+#include <QStringList>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+* Microbenchmarks of every stage of the recognition pipeline.
+*
+* Usage: BENCHMARK [--resource <directory>] [--min-time <seconds>] [--filter <text>] [--output <results.json>]
+*
+* Every stage is measured on each glyph of the resource directory and on synthetic
+* strokes drawn on canvases of several sizes. A stage is repeated until it ran for at
+* least --min-time seconds (0.2 by default). Results are written as JSON to --output,
+* or stdout, so runs of different commits can be compared. A table is printed to stderr.
+*
+* Bytes allocated per op count the memory requested through operator new and the
+* buffers of every cv::Mat created. Buffers Qt allocates for a QImage are not counted.
+*
+* OpenCV runs on a single thread so the results do not depend on the core count.
+* The kNN stages are skipped if no model is found in the resource directory.
+*/
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+namespace {
+    std::atomic<uint64_t> sAllocatedBytes{0};
+    std::atomic<uint64_t> sAllocations{0};
+
+    void
+    pCountAllocation(size_t aSize) {
+        sAllocatedBytes.fetch_add(aSize, std::memory_order_relaxed);
+        sAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+    * Counts the buffers of every cv::Mat, then leaves the allocation to the standard
+    * allocator. Matrices record the standard allocator as their owner, so they are
+    * released by it directly.
+    */
+    class CountingMatAllocator : public cv::MatAllocator {
+    public:
+        CountingMatAllocator() : mAllocator(cv::Mat::getStdAllocator()) {}
+
+        cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                               cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override {
+            cv::UMatData* matData = mAllocator->allocate(dims, sizes, type, data, step, flags, usageFlags);
+            if(matData && !data)
+                pCountAllocation(matData->size);
+            return matData;
+        }
+
+        bool allocate(cv::UMatData* data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override {
+            return mAllocator->allocate(data, accessFlags, usageFlags);
+        }
+
+        void deallocate(cv::UMatData* data) const override {
+            mAllocator->deallocate(data);
+        }
+
+    private:
+        cv::MatAllocator* mAllocator;
+    };
+
+    // Same scales as TechniqueMethods::ROIRescaling().
+    const std::vector<float> RESCALING_SCALARS = {.70f, .75f, .80f, .85f, .90f, .95f, 1.0f, 1.05f, 1.10f};
+
+    // Canvas sizes of the synthetic strokes. 384 is the size of the application canvas.
+    const std::vector<int> SYNTHETIC_SIZES = {128, 384, 768, 1536};
+
+    // Pen width of the application canvas, scaled with the synthetic canvases.
+    constexpr int APPLICATION_PEN_WIDTH = 30;
+    constexpr int APPLICATION_CANVAS_SIZE = 384;
+
+    // Stops a stage from being repeated forever if it is close to free.
+    constexpr uint64_t MAX_ITERATIONS = 1ull << 30;
+
+    // Keeps the result of a stage observable so it is not optimized away.
+    volatile int64_t sSink = 0;
+
+    struct Input {
+        std::string name;
+
+        // As drawn, black on white.
+        QImage image;
+
+        // Inverted grayscale, as read back from the canvas before binarizeCharacter().
+        cv::Mat gray;
+
+        // White character on black, thresholded, the form every technique expects.
+        cv::Mat binary;
+
+        cv::Rect roi;
+
+        cv::Mat translocated;
+
+        std::vector<cv::Mat> rescaled;
+    };
+
+    struct Result {
+        std::string stage;
+        std::string input;
+        int width;
+        int height;
+        uint64_t iterations;
+        double nsPerOp;
+        double bytesPerOp;
+        double allocationsPerOp;
+        double opsPerSecond;
+        // Input canvas pixels processed per second.
+        double pixelsPerSecond;
+    };
+
+    Input
+    pMakeInput(const std::string& aName, const QImage& aImage) {
+        Input input;
+        input.name = aName;
+        input.image = aImage.convertToFormat(QImage::Format_RGB32);
+
+        cv::Mat gray = ImageMethods::qImageToCvMat(input.image);
+        cv::threshold(gray, input.binary, 127, 255, cv::THRESH_BINARY_INV);
+        ImageMethods::qImageToInvertedGray(input.image, input.gray);
+        input.roi = ImageMethods::obtainROI(input.binary);
+        if(!input.roi.empty()) {
+            input.translocated = ImageMethods::translocateROI(input.binary(input.roi), input.binary.rows, input.binary.cols);
+            input.rescaled = ImageMethods::rescaleROI(RESCALING_SCALARS, input.binary(input.roi).clone(),
+                                                      input.binary.rows, input.binary.cols, false);
+        }
+        return input;
+    }
+
+    // Random smooth strokes, the kind of drawing the application gets.
+    QImage
+    pMakeStrokes(int aSize, std::mt19937& aGenerator) {
+        cv::Mat canvas(aSize, aSize, CV_8UC4, cv::Scalar(255, 255, 255, 255));
+        const int penWidth = std::max(1, aSize * APPLICATION_PEN_WIDTH / APPLICATION_CANVAS_SIZE);
+        std::uniform_real_distribution<double> position(aSize * .2, aSize * .8);
+        std::normal_distribution<double> step(0.0, aSize * .06);
+
+        for(int stroke = 0; stroke < 4; ++stroke) {
+            std::vector<cv::Point> points;
+            cv::Point2d point(position(aGenerator), position(aGenerator));
+            cv::Point2d direction(step(aGenerator), step(aGenerator));
+            for(int sample = 0; sample < 12; ++sample) {
+                points.emplace_back(cv::Point(cvRound(point.x), cvRound(point.y)));
+                direction = direction * .7 + cv::Point2d(step(aGenerator), step(aGenerator)) * .3;
+                point.x = std::clamp(point.x + direction.x, aSize * .1, aSize * .9);
+                point.y = std::clamp(point.y + direction.y, aSize * .1, aSize * .9);
+            }
+            cv::polylines(canvas, points, false, cv::Scalar(0, 0, 0, 255), penWidth, cv::LINE_AA);
+        }
+
+        QImage image(canvas.data, canvas.cols, canvas.rows, static_cast<int>(canvas.step), QImage::Format_RGB32);
+        return image.copy();
+    }
+
+    std::vector<Input>
+    pLoadInputs(const std::string& aResourceDirectory) {
+        std::vector<Input> inputs;
+        QDir resourceDir(QString::fromStdString(aResourceDirectory));
+        for(const auto& glyph : resourceDir.entryList(QStringList() << "*.png" << "*.PNG", QDir::Files, QDir::Name)) {
+            QImage image(resourceDir.filePath(glyph));
+            if(!image.isNull())
+                inputs.push_back(pMakeInput(glyph.toStdString(), image));
+        }
+
+        // Fixed seed, every run measures the same strokes.
+        std::mt19937 generator(42);
+        for(int size : SYNTHETIC_SIZES)
+            inputs.push_back(pMakeInput("strokes_" + std::to_string(size) + "x" + std::to_string(size),
+                                        pMakeStrokes(size, generator)));
+        return inputs;
+    }
+
+    /**
+    * @brief Repeat aOperation until it ran for at least aMinTime seconds, doubling the
+    * iterations between attempts. Only the last attempt is reported.
+    */
+    template<typename Operation>
+    Result
+    pMeasure(const std::string& aStage, const Input& aInput, double aMinTime, Operation&& aOperation) {
+        // Warm up caches and lazily sized buffers.
+        aOperation();
+
+        uint64_t iterations = 1;
+        while(true) {
+            const uint64_t bytesBefore = sAllocatedBytes.load(std::memory_order_relaxed);
+            const uint64_t allocationsBefore = sAllocations.load(std::memory_order_relaxed);
+            auto startTime = steady_clock::now();
+            for(uint64_t iteration = 0; iteration < iterations; ++iteration)
+                aOperation();
+            duration<double> elapsed = steady_clock::now() - startTime;
+
+            if(elapsed.count() >= aMinTime || iterations >= MAX_ITERATIONS) {
+                Result result;
+                result.stage = aStage;
+                result.input = aInput.name;
+                result.width = aInput.image.width();
+                result.height = aInput.image.height();
+                result.iterations = iterations;
+                result.nsPerOp = elapsed.count() * 1e9 / iterations;
+                result.bytesPerOp = static_cast<double>(sAllocatedBytes.load(std::memory_order_relaxed) - bytesBefore) / iterations;
+                result.allocationsPerOp = static_cast<double>(sAllocations.load(std::memory_order_relaxed) - allocationsBefore) / iterations;
+                result.opsPerSecond = iterations / elapsed.count();
+                result.pixelsPerSecond = result.opsPerSecond * result.width * result.height;
+                return result;
+            }
+
+            // Aim a little past aMinTime so the next attempt is usually the last.
+            double estimate = elapsed.count() > 0.0 ? iterations * aMinTime * 1.2 / elapsed.count() : iterations * 10.0;
+            iterations = std::min(MAX_ITERATIONS, std::max(iterations * 2, static_cast<uint64_t>(estimate)));
+        }
+    }
+
+    std::string
+    pJsonString(const std::string& aText) {
+        std::string escaped = "\"";
+        for(char character : aText) {
+            if(character == '"' || character == '\\')
+                escaped += '\\';
+            escaped += character;
+        }
+        return escaped + "\"";
+    }
+
+    void
+    pWriteJson(std::ostream& aStream, const std::vector<Result>& aResults, double aMinTime) {
+        aStream << std::setprecision(10);
+        aStream << "{\n";
+        aStream << "  \"context\": {\n";
+        aStream << "    \"opencv_version\": " << pJsonString(CV_VERSION) << ",\n";
+        aStream << "    \"distance_kernel\": " << pJsonString(BinaryFeatures::kernelName()) << ",\n";
+        aStream << "    \"opencv_threads\": " << cv::getNumThreads() << ",\n";
+        aStream << "    \"min_time_s\": " << aMinTime << "\n";
+        aStream << "  },\n";
+        aStream << "  \"benchmarks\": [\n";
+        for(size_t index = 0; index < aResults.size(); ++index) {
+            const Result& result = aResults[index];
+            aStream << "    {"
+                    << "\"stage\": " << pJsonString(result.stage)
+                    << ", \"input\": " << pJsonString(result.input)
+                    << ", \"width\": " << result.width
+                    << ", \"height\": " << result.height
+                    << ", \"iterations\": " << result.iterations
+                    << ", \"ns_per_op\": " << result.nsPerOp
+                    << ", \"bytes_per_op\": " << result.bytesPerOp
+                    << ", \"allocations_per_op\": " << result.allocationsPerOp
+                    << ", \"ops_per_second\": " << result.opsPerSecond
+                    << ", \"pixels_per_second\": " << result.pixelsPerSecond
+                    << "}" << (index + 1 < aResults.size() ? ",\n" : "\n");
+        }
+        aStream << "  ]\n";
+        aStream << "}\n";
+    }
+}
+
+// Every heap allocation of the C++ runtime goes through here and is counted.
+void* operator new(std::size_t aSize) {
+    pCountAllocation(aSize);
+    if(void* memory = std::malloc(aSize ? aSize : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t aSize) {
+    return ::operator new(aSize);
+}
+
+void operator delete(void* aMemory) noexcept {
+    std::free(aMemory);
+}
+
+void operator delete[](void* aMemory) noexcept {
+    std::free(aMemory);
+}
+
+void operator delete(void* aMemory, std::size_t) noexcept {
+    std::free(aMemory);
+}
+
+void operator delete[](void* aMemory, std::size_t) noexcept {
+    std::free(aMemory);
+}
+
+int main(int argc, char* argv[]) {
+    std::string resourceDirectory = "../resource";
+    std::string outputPath;
+    std::string filter;
+    double minTime = 0.2;
+    for(int arg = 1; arg < argc; ++arg) {
+        if(std::strcmp(argv[arg], "--resource") == 0 && arg + 1 < argc)
+            resourceDirectory = argv[++arg];
+        else if(std::strcmp(argv[arg], "--min-time") == 0 && arg + 1 < argc)
+            minTime = std::atof(argv[++arg]);
+        else if(std::strcmp(argv[arg], "--filter") == 0 && arg + 1 < argc)
+            filter = argv[++arg];
+        else if(std::strcmp(argv[arg], "--output") == 0 && arg + 1 < argc)
+            outputPath = argv[++arg];
+        else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--resource <directory>] [--min-time <seconds>] [--filter <text>] [--output <results.json>]\n";
+            return 1;
+        }
+    }
+
+    cv::setNumThreads(1);
+    static CountingMatAllocator matAllocator;
+    cv::Mat::setDefaultAllocator(&matAllocator);
+
+    std::vector<Input> inputs = pLoadInputs(resourceDirectory);
+
+    cv::Ptr<cv::ml::KNearest> kNN;
+    try {
+        kNN = cv::ml::KNearest::load(resourceDirectory + "/kNN_ETL_Subset.opknn");
+    } catch(const cv::Exception&) {
+        kNN.release();
+    }
+    cv::Ptr<BinaryKNearest> binaryKNN = ModelFile::load(resourceDirectory + "/kNN_ETL_Subset.jpknn");
+    if(binaryKNN->empty())
+        binaryKNN = BinaryKNearest::load(resourceDirectory + "/kNN_ETL_Subset.opknn");
+    const bool haveKNN = kNN && kNN->isTrained();
+    if(!haveKNN || binaryKNN->empty())
+        std::cerr << "No model found in " << resourceDirectory << ", the kNN stages are skipped\n";
+
+    std::vector<Result> results;
+    auto run = [&](const std::string& aStage, const Input& aInput, auto&& aOperation) {
+        if(!filter.empty() && aStage.find(filter) == std::string::npos && aInput.name.find(filter) == std::string::npos)
+            return;
+        results.push_back(pMeasure(aStage, aInput, minTime, aOperation));
+        const Result& result = results.back();
+        std::cerr << std::left << std::setw(36) << result.stage << std::setw(22) << result.input << std::right
+                  << std::fixed << std::setprecision(0) << std::setw(14) << result.nsPerOp << " ns/op"
+                  << std::setw(12) << result.bytesPerOp << " B/op"
+                  << std::setprecision(1) << std::setw(12) << result.opsPerSecond << " op/s\n";
+    };
+
+    for(const Input& input : inputs) {
+        if(input.roi.empty()) {
+            std::cerr << "No character found in " << input.name << ", skipped\n";
+            continue;
+        }
+        const cv::Mat roiImage = input.binary(input.roi);
+        const int rows = input.binary.rows;
+        const int cols = input.binary.cols;
+
+        run("qImageToCvMat", input, [&]() {
+            sSink = sSink + ImageMethods::qImageToCvMat(input.image).rows;
+        });
+        run("obtainROI", input, [&]() {
+            sSink = sSink + ImageMethods::obtainROI(input.binary).width;
+        });
+        run("translocateROI", input, [&]() {
+            sSink = sSink + ImageMethods::translocateROI(roiImage, rows, cols).rows;
+        });
+        run("rescaleROI", input, [&]() {
+            sSink = sSink + ImageMethods::rescaleROI(RESCALING_SCALARS, roiImage, rows, cols, false).size();
+        });
+        run("prepareMatrixForKNN", input, [&]() {
+            sSink = sSink + ImageMethods::prepareMatrixForKNN(input.translocated).cols;
+        });
+        run("prepareBatchForKNN", input, [&]() {
+            sSink = sSink + ImageMethods::prepareBatchForKNN(input.rescaled).rows;
+        });
+
+        // The stages the application, BATCH_RECOGNIZE and TRAIN_MODEL run. Buffers are
+        // reused between ops like they are between recognitions.
+        cv::Mat canvas;
+        run("qImageToInvertedGray", input, [&]() {
+            ImageMethods::qImageToInvertedGray(input.image, canvas);
+            sSink = sSink + canvas.rows;
+        });
+        // Binarizes in place, every op starts from a copy of the grayscale image.
+        cv::Mat binarized;
+        run("binarizeCharacter", input, [&]() {
+            input.gray.copyTo(binarized);
+            ImageMethods::binarizeCharacter(binarized);
+            sSink = sSink + binarized.rows;
+        });
+        ImageMethods::FeatureWorkspace workspace;
+        run("ROIRescalingFeatures", input, [&]() {
+            sSink = sSink + TechniqueMethods::ROIRescalingFeatures(input.binary, input.roi, workspace).rows;
+        });
+        run("ROIRescalingFeatures[new workspace]", input, [&]() {
+            ImageMethods::FeatureWorkspace freshWorkspace;
+            sSink = sSink + TechniqueMethods::ROIRescalingFeatures(input.binary, input.roi, freshWorkspace).rows;
+        });
+
+        if(!haveKNN || binaryKNN->empty())
+            continue;
+
+        run("passThroughKNNModel", input, [&]() {
+            sSink = sSink + ImageMethods::passThroughKNNModel(kNN, input.translocated);
+        });
+        run("passThroughKNNModel[scales]", input, [&]() {
+            sSink = sSink + ImageMethods::passThroughKNNModel(kNN, input.rescaled);
+        });
+        run("passThroughKNNModel[binary]", input, [&]() {
+            sSink = sSink + ImageMethods::passThroughKNNModel(binaryKNN, input.translocated);
+        });
+        run("passThroughKNNModel[binary,scales]", input, [&]() {
+            sSink = sSink + ImageMethods::passThroughKNNModel(binaryKNN, input.rescaled);
+        });
+
+        const cv::Mat features = TechniqueMethods::ROIRescalingFeatures(input.binary, input.roi, workspace).clone();
+        cv::Mat nearest, neighbours, distances;
+        if(!features.empty()) {
+            run("findNearest[binary,features]", input, [&]() {
+                sSink = sSink + static_cast<int64_t>(binaryKNN->findNearest(features, KNN_NEIGHBOURS, nearest,
+                                                                             neighbours, distances));
+            });
+        }
+
+        const std::vector<int> labels = ImageMethods::passThroughKNNModelBatch(binaryKNN, input.rescaled);
+        run("findMostFrequentLabel", input, [&]() {
+            sSink = sSink + ImageMethods::findMostFrequentLabel(labels);
+        });
+    }
+
+    if(outputPath.empty()) {
+        pWriteJson(std::cout, results, minTime);
+    } else {
+        std::ofstream output(outputPath);
+        if(!output) {
+            std::cerr << "Unable to write " << outputPath << "\n";
+            return 1;
+        }
+        pWriteJson(output, results, minTime);
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include "BinaryKNN.hpp"
+#include "VPTreeIndex.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+
+/**
+* Offline tool building the nearest neighbour index for a kNN model.
+*
+* Usage: BUILD_INDEX <model.opknn> [--output <index.vpt>] [--leaf <size>] [--queries <count>] [--budget <count>]
+*
+* The index is written next to the model (same name, .vpt extension) unless --output is given.
+* Recall and latency of several search budgets are measured against brute force search
+* and printed so a budget can be picked. The budget given with --budget is stored in the
+* index and used by everything loading it, 0 (the default) keeps the search exact.
+*/
+
+using std::chrono::high_resolution_clock;
+using std::chrono::duration;
+
+namespace {
+    // Fraction of the bits flipped in the training samples used as queries. Queries drawn
+    // by users never exactly match a reference sample.
+    constexpr double QUERY_NOISE = 0.05;
+
+    std::string
+    pDefaultIndexPath(const std::string& aModelPath) {
+        auto extension = aModelPath.find_last_of('.');
+        auto separator = aModelPath.find_last_of("/\\");
+        if(extension == std::string::npos || (separator != std::string::npos && extension < separator))
+            return aModelPath + ".vpt";
+        return aModelPath.substr(0, extension) + ".vpt";
+    }
+
+    cv::Mat
+    pMakeQueries(const cv::Mat& aPackedSamples, int aCount, std::mt19937& aGenerator) {
+        cv::Mat queries(aCount, FEATURE_ROW_STRIDE, CV_8U);
+        std::uniform_int_distribution<int> sampleDistribution(0, aPackedSamples.rows - 1);
+        std::uniform_int_distribution<int> bitDistribution(0, FEATURE_BITS - 1);
+        const int flips = static_cast<int>(FEATURE_BITS * QUERY_NOISE);
+
+        for(int query = 0; query < aCount; ++query) {
+            aPackedSamples.row(sampleDistribution(aGenerator)).copyTo(queries.row(query));
+            uint8_t* row = queries.ptr<uint8_t>(query);
+            for(int flip = 0; flip < flips; ++flip) {
+                int bit = bitDistribution(aGenerator);
+                row[bit >> 3] ^= static_cast<uint8_t>(1u << (bit & 7));
+            }
+        }
+        return queries;
+    }
+
+    // Average latency of a single query in microseconds.
+    double
+    pMeasureLatency(const VPTreeIndex& aIndex, const cv::Mat& aPackedSamples, const cv::Mat& aQueries) {
+        std::vector<VPTreeIndex::Neighbour> neighbours;
+        auto startTime = high_resolution_clock::now();
+        for(int query = 0; query < aQueries.rows; ++query)
+            aIndex.search(aPackedSamples, aQueries.ptr<uint8_t>(query), KNN_NEIGHBOURS, neighbours);
+        duration<double, std::micro> elapsed = high_resolution_clock::now() - startTime;
+        return elapsed.count() / aQueries.rows;
+    }
+
+    double
+    pMeasureBruteForceLatency(const cv::Mat& aPackedSamples, const cv::Mat& aQueries) {
+        std::vector<uint32_t> distances(aPackedSamples.rows);
+        auto startTime = high_resolution_clock::now();
+        for(int query = 0; query < aQueries.rows; ++query)
+            BinaryFeatures::hammingDistances(aQueries.ptr<uint8_t>(query), aPackedSamples.ptr<uint8_t>(0),
+                                             distances.size(), distances.data());
+        duration<double, std::micro> elapsed = high_resolution_clock::now() - startTime;
+        return elapsed.count() / aQueries.rows;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 2) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <model.opknn> [--output <index.vpt>] [--leaf <size>] [--queries <count>] [--budget <count>]\n";
+        return 1;
+    }
+
+    std::string modelPath = argv[1];
+    std::string indexPath = pDefaultIndexPath(modelPath);
+    int leafSize = 16;
+    int queryCount = 500;
+    int searchBudget = 0;
+    for(int arg = 2; arg < argc; ++arg) {
+        const bool known = std::strcmp(argv[arg], "--output") == 0 || std::strcmp(argv[arg], "--leaf") == 0
+            || std::strcmp(argv[arg], "--queries") == 0 || std::strcmp(argv[arg], "--budget") == 0;
+        if(!known) {
+            std::cerr << "Unknown argument: " << argv[arg] << "\n";
+            return 1;
+        }
+        if(arg + 1 >= argc) {
+            std::cerr << "Missing value for " << argv[arg] << "\n";
+            return 1;
+        }
+
+        const char* value = argv[++arg];
+        if(std::strcmp(argv[arg - 1], "--output") == 0)
+            indexPath = value;
+        else if(std::strcmp(argv[arg - 1], "--leaf") == 0)
+            leafSize = std::max(1, std::atoi(value));
+        else if(std::strcmp(argv[arg - 1], "--queries") == 0)
+            queryCount = std::max(1, std::atoi(value));
+        else
+            searchBudget = std::max(0, std::atoi(value));
+    }
+
+    cv::Ptr<BinaryKNearest> model = BinaryKNearest::load(modelPath);
+    if(model->empty()) {
+        std::cerr << "Unable to load samples from " << modelPath << "\n";
+        return 1;
+    }
+    const cv::Mat& samples = model->getPackedSamples();
+    std::cout << "Loaded " << samples.rows << " samples (" << BinaryFeatures::kernelName() << " kernel)\n";
+
+    auto startTime = high_resolution_clock::now();
+    cv::Ptr<VPTreeIndex> index = VPTreeIndex::build(samples, leafSize);
+    duration<double, std::milli> buildTime = high_resolution_clock::now() - startTime;
+    std::cout << "Built index in " << buildTime.count() << " ms\n";
+
+    index->setSearchBudget(searchBudget);
+
+    if(!index->save(indexPath)) {
+        std::cerr << "Unable to write " << indexPath << "\n";
+        return 1;
+    }
+    std::cout << "Wrote " << indexPath << " with a search budget of " << searchBudget
+              << (searchBudget ? "" : " (exact)") << "\n\n";
+
+    std::mt19937 generator(5489u);
+    cv::Mat queries = pMakeQueries(samples, queryCount, generator);
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "BRUTE FORCE [ LATENCY (us) ] -> [ " << pMeasureBruteForceLatency(samples, queries) << " ]\n";
+
+    // Budgets given as a fraction of the reference set, 0 is the exact search.
+    for(double fraction : {0.0, 0.5, 0.25, 0.1, 0.05, 0.02, 0.01}) {
+        int budget = static_cast<int>(fraction * samples.rows);
+        if(fraction > 0.0 && budget < KNN_NEIGHBOURS)
+            continue;
+        index->setSearchBudget(budget);
+        double recall = index->measureRecall(samples, queries, KNN_NEIGHBOURS);
+        double latency = pMeasureLatency(*index, samples, queries);
+        std::cout << "BUDGET " << std::setw(8) << budget << " [ RECALL@" << KNN_NEIGHBOURS << " : LATENCY (us) ] -> [ "
+                  << recall * 100.0 << "% : " << latency << " ]\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include "ModelFile.hpp"
+
+#include <iostream>
+#include <string>
+
+/**
+* Converts a serialized cv::ml::KNearest model (.opknn) to the memory mappable model format (.jpknn).
+*
+* Usage: CONVERT_MODEL <model.opknn> [output.jpknn]
+*
+* Without an output path, the model file is written next to the OpenCV model.
+*/
+
+namespace {
+    std::string
+    pDefaultModelPath(const std::string& aOpknnPath) {
+        auto extension = aOpknnPath.find_last_of('.');
+        auto separator = aOpknnPath.find_last_of("/\\");
+        if(extension == std::string::npos || (separator != std::string::npos && extension < separator))
+            return aOpknnPath + ".jpknn";
+        return aOpknnPath.substr(0, extension) + ".jpknn";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <model.opknn> [output.jpknn]\n";
+        return 1;
+    }
+
+    std::string opknnPath = argv[1];
+    std::string modelPath = argc > 2 ? argv[2] : pDefaultModelPath(opknnPath);
+
+    if(!ModelFile::convertFromOpknn(opknnPath, modelPath)) {
+        std::cerr << "Unable to convert " << opknnPath << " to " << modelPath << "\n";
+        return 1;
+    }
+
+    std::vector<int> labels;
+    cv::Ptr<BinaryKNearest> model = ModelFile::load(modelPath, &labels);
+    if(model->empty()) {
+        std::cerr << "Written model " << modelPath << " could not be read back\n";
+        return 1;
+    }
+
+    std::cout << "Wrote " << modelPath << " [ SAMPLES : LABELS ] -> [ "
+              << model->getSampleCount() << " : " << labels.size() << " ]\n";
+    return 0;
+}
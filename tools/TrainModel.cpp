@@ -0,0 +1,484 @@
+#include "BinaryKNN.hpp"
+#include "ImageProcessMethods.hpp"
+#include "ModelFile.hpp"
+#include "WorkStealingPool.hpp"
+
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/ml.hpp"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <QString>
+#include <QStringList>
+#include <QTextStream>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+* Trains a kNN model from labelled character images or ETL records.
+*
+* Usage: TRAIN_MODEL [--output <model.jpknn>] [--opknn <model.opknn>] [--dictionary <kNNDictionary.txt>]
+*                    [--threads <count>] <directory|ETL file>...
+*
+* Inputs:
+*   - A directory of PNG images. An image is labelled by the subdirectory of the input it is in
+*     (KA/0001.png), or by the end of its file name (0001_KA.png) if it is directly in the input.
+*   - Any other file is read as ETL M-type records (ETL-1 to ETL-7): 2052 byte records holding
+*     a 64 x 63 image with 16 gray levels, labelled by the character code of the record ("KA").
+*     Nothing is trained if a file is not a whole number of records with printable codes.
+*
+* Every sample goes through the recognition preprocessing: it is binarized, its ROI is centered
+* and it is prepared as the 1.0 scale of TechniqueMethods::ROIRescalingFeatures(). The model is
+* trained on exactly the features it is queried with.
+*
+* Samples are read in chunks that are preprocessed on a work stealing pool. Only a few chunks per
+* thread are held at once and they are written in input order as they complete, so the memory
+* used does not depend on the size of the dataset and the model does not depend on the thread count.
+*
+* With --dictionary, labels are taken from that file and samples of any other character are
+* skipped, e.g. to train on the katakana of ETL-1 only. Otherwise every character gets a label,
+* in order of first appearance. The labels are written next to the model as kNNDictionary.txt.
+*
+* --opknn also writes a cv::ml::KNearest model. It holds every sample in memory as floats.
+*/
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+namespace {
+    // ETL M-type record, offsets as given by the ETL Character Database specification.
+    constexpr size_t ETL_RECORD_SIZE = 2052;
+    constexpr size_t ETL_CODE_OFFSET = 2;
+    constexpr size_t ETL_CODE_SIZE = 2;
+    constexpr size_t ETL_IMAGE_OFFSET = 32;
+    constexpr int ETL_IMAGE_WIDTH = 64;
+    constexpr int ETL_IMAGE_HEIGHT = 63;
+    // Two 4 bit pixels per byte, the first one in the high bits.
+    constexpr size_t ETL_IMAGE_SIZE = ETL_IMAGE_WIDTH * ETL_IMAGE_HEIGHT / 2;
+
+    // Samples preprocessed by a single task.
+    constexpr size_t CHUNK_SIZE = 256;
+
+    // Chunks read but not written yet, per thread of the pool.
+    constexpr size_t CHUNKS_IN_FLIGHT_PER_THREAD = 4;
+
+    const std::vector<float> TRAINING_SCALARS = {1.0f};
+
+    struct Sample {
+        int label;
+        // Image file. Empty for an ETL record, whose image is in etlImage.
+        std::string path;
+        std::array<uint8_t, ETL_IMAGE_SIZE> etlImage;
+    };
+
+    struct Chunk {
+        size_t index = 0;
+        std::vector<Sample> samples;
+
+        // Filled by pPrepareChunk(), one row per sample kept.
+        cv::Mat packed;
+        cv::Mat features;
+        std::vector<int> labels;
+        size_t skipped = 0;
+    };
+
+    // Characters and their labels, as stored in kNNDictionary.txt.
+    class Dictionary {
+    public:
+        bool load(const std::string& aFilepath) {
+            QFile file(QString::fromStdString(aFilepath));
+            if(!file.open(QIODevice::ReadOnly | QIODevice::Text))
+                return false;
+
+            QTextStream in(&file);
+            QRegularExpression regexprLine("(?<character>\\w+),(?<number>\\d+)");
+            while(!in.atEnd()) {
+                auto match = regexprLine.match(in.readLine());
+                if(match.hasMatch())
+                    mLabels[match.captured("character").toStdString()] = match.captured("number").toInt();
+            }
+            mFixed = true;
+            return !mLabels.empty();
+        }
+
+        bool save(const std::string& aFilepath) const {
+            std::map<int, std::string> characters;
+            for(const auto& label : mLabels)
+                characters[label.second] = label.first;
+
+            std::ofstream file(aFilepath, std::ios::trunc);
+            for(const auto& character : characters)
+                file << character.second << "," << character.first << "\n";
+            return static_cast<bool>(file);
+        }
+
+        // Label of aCharacter, -1 if the dictionary was loaded and does not hold it.
+        int labelOf(const std::string& aCharacter) {
+            auto label = mLabels.find(aCharacter);
+            if(label != mLabels.end())
+                return label->second;
+            if(mFixed || aCharacter.empty())
+                return -1;
+            const int next = static_cast<int>(mLabels.size());
+            mLabels.emplace(aCharacter, next);
+            return next;
+        }
+
+        size_t size() const { return mLabels.size(); }
+
+    private:
+        std::map<std::string, int> mLabels;
+        bool mFixed = false;
+    };
+
+    // Appends preprocessed chunks to the model in the order they were read, whatever
+    // order they complete in, and bounds the number of chunks in flight.
+    class ChunkWriter {
+    public:
+        ChunkWriter(ModelFileWriter& aModel, size_t aMaxInFlight, cv::Mat* aOpknnSamples, cv::Mat* aOpknnResponses)
+            : mModel(aModel), mMaxInFlight(aMaxInFlight), mOpknnSamples(aOpknnSamples),
+              mOpknnResponses(aOpknnResponses) {}
+
+        // Reserve the index of the next chunk. Blocks while too many chunks are in flight.
+        size_t acquire() {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWritten.wait(lock, [this]() { return mRead - mNextToWrite < mMaxInFlight; });
+            return mRead++;
+        }
+
+        void complete(std::unique_ptr<Chunk> aChunk) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mPending[aChunk->index] = std::move(aChunk);
+            for(auto next = mPending.find(mNextToWrite); next != mPending.end(); next = mPending.find(mNextToWrite)) {
+                const Chunk& chunk = *next->second;
+                for(size_t row = 0; row < chunk.labels.size(); ++row)
+                    mModel.append(chunk.packed.ptr<uint8_t>(static_cast<int>(row)), chunk.labels[row]);
+                if(mOpknnSamples && !chunk.labels.empty()) {
+                    mOpknnSamples->push_back(chunk.features);
+                    mOpknnResponses->push_back(cv::Mat(chunk.labels, true));
+                }
+                mSkipped += chunk.skipped;
+                mPending.erase(next);
+                ++mNextToWrite;
+            }
+            mWritten.notify_all();
+        }
+
+        size_t getSkippedCount() const { return mSkipped; }
+
+    private:
+        ModelFileWriter& mModel;
+        size_t mMaxInFlight;
+        cv::Mat* mOpknnSamples;
+        cv::Mat* mOpknnResponses;
+
+        std::mutex mMutex;
+        std::condition_variable mWritten;
+        size_t mRead = 0;
+        size_t mNextToWrite = 0;
+        std::map<size_t, std::unique_ptr<Chunk>> mPending;
+        size_t mSkipped = 0;
+    };
+
+    cv::Mat
+    pDecodeEtlImage(const std::array<uint8_t, ETL_IMAGE_SIZE>& aImage) {
+        cv::Mat image(ETL_IMAGE_HEIGHT, ETL_IMAGE_WIDTH, CV_8U);
+        uchar* pixel = image.ptr<uchar>(0);
+        for(uint8_t pair : aImage) {
+            // Spread the 16 gray levels over 0 - 255.
+            *pixel++ = static_cast<uchar>((pair >> 4) * 17);
+            *pixel++ = static_cast<uchar>((pair & 0x0f) * 17);
+        }
+        return image;
+    }
+
+    /**
+    * @brief The recognition preprocessing, at the 1.0 scale only.
+    * @return The prepared feature row, empty if no character was found.
+    */
+    cv::Mat
+    pPrepareSample(cv::Mat& aImage) {
+        if(aImage.cols < 3 || aImage.rows < 3)
+            return cv::Mat();
+        ImageMethods::binarizeCharacter(aImage);
+
+        cv::Rect roi = ImageMethods::obtainROI(aImage);
+        if(roi.empty())
+            return cv::Mat();
+
+        // Every worker keeps its own buffers between samples.
+        thread_local ImageMethods::FeatureWorkspace workspace;
+        return ImageMethods::rescaleROIToFeatures(TRAINING_SCALARS, aImage, roi, workspace);
+    }
+
+    void
+    pPrepareChunk(Chunk& aChunk, bool aKeepFeatures) {
+        aChunk.packed.create(static_cast<int>(aChunk.samples.size()), FEATURE_ROW_STRIDE, CV_8U);
+        for(const Sample& sample : aChunk.samples) {
+            cv::Mat features;
+            try {
+                cv::Mat image = sample.path.empty()
+                    ? pDecodeEtlImage(sample.etlImage)
+                    : cv::imread(sample.path, cv::IMREAD_GRAYSCALE);
+                if(!image.empty())
+                    features = pPrepareSample(image);
+            } catch(const cv::Exception& ex) {
+                std::cerr << (sample.path.empty() ? "ETL record" : sample.path) << ": " << ex.what() << "\n";
+            }
+            if(features.empty()) {
+                ++aChunk.skipped;
+                continue;
+            }
+
+            const int row = static_cast<int>(aChunk.labels.size());
+            BinaryFeatures::packRow(features.row(0), aChunk.packed.ptr<uint8_t>(row));
+            if(aKeepFeatures)
+                aChunk.features.push_back(features.row(0));
+            aChunk.labels.push_back(sample.label);
+        }
+        // Only the prepared samples are kept until the chunk is written.
+        aChunk.samples = std::vector<Sample>();
+    }
+
+    // Label of an image directly in an input directory: the end of its file name, 0001_KA.png -> KA.
+    QString
+    pLabelFromFileName(const QString& aFileName) {
+        QString baseName = QFileInfo(aFileName).completeBaseName();
+        return baseName.mid(baseName.lastIndexOf('_') + 1);
+    }
+
+    /**
+    * @brief Call aVisit with every PNG under aDirectory and its label, sorted by name so
+    * that the samples are read in the same order on every run.
+    * @param aLabel Label of the images in aDirectory, empty for an input directory.
+    */
+    void
+    pVisitImages(const QDir& aDirectory, const QString& aLabel,
+                 const std::function<void(const std::string&, const std::string&)>& aVisit) {
+        for(const auto& image : aDirectory.entryList(QStringList() << "*.png" << "*.PNG", QDir::Files, QDir::Name)) {
+            QString label = aLabel.isEmpty() ? pLabelFromFileName(image) : aLabel;
+            aVisit(aDirectory.filePath(image).toStdString(), label.toStdString());
+        }
+        for(const auto& subdirectory : aDirectory.entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name)) {
+            pVisitImages(QDir(aDirectory.filePath(subdirectory)), aLabel.isEmpty() ? subdirectory : aLabel,
+                         aVisit);
+        }
+    }
+
+    /**
+    * @brief Whether aFilepath looks like an ETL M-type file: a whole number of records, each with
+    * a printable ASCII character code. Only the codes are read.
+    */
+    bool
+    pIsEtlFile(const std::string& aFilepath) {
+        std::ifstream file(aFilepath, std::ios::binary | std::ios::ate);
+        if(!file)
+            return false;
+        const std::streamoff size = file.tellg();
+        const std::streamoff recordSize = static_cast<std::streamoff>(ETL_RECORD_SIZE);
+        if(size <= 0 || size % recordSize != 0)
+            return false;
+
+        std::array<char, ETL_CODE_SIZE> code;
+        for(std::streamoff record = 0; record < size; record += recordSize) {
+            if(!file.seekg(record + static_cast<std::streamoff>(ETL_CODE_OFFSET)) || !file.read(code.data(), code.size()))
+                return false;
+            for(char byte : code) {
+                if(byte < 0x20 || byte > 0x7e)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+    * @brief Call aVisit with every record of an ETL M-type file.
+    * @return false if the file could not be read or does not hold whole records.
+    */
+    bool
+    pVisitEtlRecords(const std::string& aFilepath,
+                     const std::function<void(const std::string&, const uint8_t*)>& aVisit) {
+        std::ifstream file(aFilepath, std::ios::binary);
+        if(!file)
+            return false;
+
+        std::array<char, ETL_RECORD_SIZE> record;
+        while(file.read(record.data(), record.size())) {
+            std::string code(record.data() + ETL_CODE_OFFSET, ETL_CODE_SIZE);
+            code.erase(code.find_last_not_of(' ') + 1);
+            code.erase(0, code.find_first_not_of(' '));
+            aVisit(code, reinterpret_cast<const uint8_t*>(record.data()) + ETL_IMAGE_OFFSET);
+        }
+        // A trailing partial record means this is not an ETL file.
+        return file.gcount() == 0;
+    }
+
+    std::string
+    pDictionaryPath(const std::string& aModelPath) {
+        QFileInfo info(QString::fromStdString(aModelPath));
+        return info.dir().filePath("kNNDictionary.txt").toStdString();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string modelPath = "kNN_Trained.jpknn";
+    std::string opknnPath;
+    std::string dictionaryPath;
+    unsigned threadCount = 0;
+    std::vector<std::string> inputs;
+    for(int arg = 1; arg < argc; ++arg) {
+        if(std::strcmp(argv[arg], "--output") == 0 && arg + 1 < argc) {
+            modelPath = argv[++arg];
+        } else if(std::strcmp(argv[arg], "--opknn") == 0 && arg + 1 < argc) {
+            opknnPath = argv[++arg];
+        } else if(std::strcmp(argv[arg], "--dictionary") == 0 && arg + 1 < argc) {
+            dictionaryPath = argv[++arg];
+        } else if(std::strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            threadCount = static_cast<unsigned>(std::max(0, std::atoi(argv[++arg])));
+        } else if(std::strncmp(argv[arg], "--", 2) == 0) {
+            std::cerr << "Unknown argument: " << argv[arg] << "\n";
+            return 1;
+        } else {
+            inputs.push_back(argv[arg]);
+        }
+    }
+    if(inputs.empty()) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--output <model.jpknn>] [--opknn <model.opknn>] [--dictionary <kNNDictionary.txt>]"
+                  << " [--threads <count>] <directory|ETL file>...\n";
+        return 1;
+    }
+
+    Dictionary dictionary;
+    if(!dictionaryPath.empty() && !dictionary.load(dictionaryPath)) {
+        std::cerr << "Unable to read labels from " << dictionaryPath << "\n";
+        return 1;
+    }
+
+    // Checked before the model is truncated, a wrong file must not end up as training samples.
+    for(const auto& input : inputs) {
+        if(!QFileInfo(QString::fromStdString(input)).isDir() && !pIsEtlFile(input)) {
+            std::cerr << input << " is neither a directory nor an ETL M-type file\n";
+            return 1;
+        }
+    }
+
+    ModelFileWriter model(modelPath);
+    if(!model.isOpen()) {
+        std::cerr << "Unable to write " << modelPath << "\n";
+        return 1;
+    }
+
+    WorkStealingPool pool(threadCount);
+    std::cerr << "Training on " << pool.getThreadCount() << " threads\n";
+
+    cv::Mat opknnSamples, opknnResponses;
+    const bool keepFeatures = !opknnPath.empty();
+    ChunkWriter writer(model, pool.getThreadCount() * CHUNKS_IN_FLIGHT_PER_THREAD,
+                       keepFeatures ? &opknnSamples : nullptr, keepFeatures ? &opknnResponses : nullptr);
+
+    // Samples whose character is not in the dictionary.
+    size_t unlabelled = 0;
+    size_t readCount = 0;
+    std::unique_ptr<Chunk> chunk;
+    auto submitChunk = [&]() {
+        if(!chunk)
+            return;
+        chunk->index = writer.acquire();
+        pool.submit([&writer, keepFeatures, current = chunk.release()]() {
+            std::unique_ptr<Chunk> owned(current);
+            pPrepareChunk(*owned, keepFeatures);
+            writer.complete(std::move(owned));
+        });
+    };
+    auto nextSample = [&](const std::string& aCharacter) -> Sample* {
+        const int label = dictionary.labelOf(aCharacter);
+        if(label < 0) {
+            ++unlabelled;
+            return nullptr;
+        }
+        if(!chunk) {
+            chunk = std::make_unique<Chunk>();
+            chunk->samples.reserve(CHUNK_SIZE);
+        }
+        chunk->samples.emplace_back();
+        Sample* sample = &chunk->samples.back();
+        sample->label = label;
+        ++readCount;
+        return sample;
+    };
+    auto sampleAdded = [&]() {
+        if(chunk->samples.size() == CHUNK_SIZE)
+            submitChunk();
+    };
+
+    bool readFailed = false;
+    auto startTime = steady_clock::now();
+    for(const auto& input : inputs) {
+        QFileInfo info(QString::fromStdString(input));
+        if(info.isDir()) {
+            pVisitImages(QDir(info.filePath()), QString(), [&](const std::string& aPath, const std::string& aCharacter) {
+                if(Sample* sample = nextSample(aCharacter)) {
+                    sample->path = aPath;
+                    sampleAdded();
+                }
+            });
+        } else if(!pVisitEtlRecords(input, [&](const std::string& aCharacter, const uint8_t* aImage) {
+                      if(Sample* sample = nextSample(aCharacter)) {
+                          std::memcpy(sample->etlImage.data(), aImage, ETL_IMAGE_SIZE);
+                          sampleAdded();
+                      }
+                  })) {
+            std::cerr << "Unable to read ETL records from " << input << "\n";
+            readFailed = true;
+            break;
+        }
+    }
+    submitChunk();
+    pool.wait();
+    if(readFailed) {
+        // The model is left without its header, ModelFile::load() rejects it.
+        return 1;
+    }
+    duration<double> elapsed = steady_clock::now() - startTime;
+
+    const int sampleCount = model.getSampleCount();
+    if(!model.finish() || sampleCount == 0) {
+        std::cerr << "Unable to write " << modelPath << (sampleCount == 0 ? ", no sample was prepared" : "") << "\n";
+        return 1;
+    }
+
+    const std::string outputDictionaryPath = pDictionaryPath(modelPath);
+    if(!dictionary.save(outputDictionaryPath)) {
+        std::cerr << "Unable to write " << outputDictionaryPath << "\n";
+        return 1;
+    }
+
+    if(!opknnPath.empty()) {
+        cv::Ptr<cv::ml::KNearest> knn = cv::ml::KNearest::create();
+        knn->setDefaultK(KNN_NEIGHBOURS);
+        knn->train(opknnSamples, cv::ml::ROW_SAMPLE, opknnResponses);
+        knn->save(opknnPath);
+    }
+
+    std::cerr << "Wrote " << modelPath << " [ SAMPLES : SKIPPED : UNLABELLED : LABELS ] -> [ " << sampleCount << " : "
+              << writer.getSkippedCount() << " : " << unlabelled << " : " << dictionary.size() << " ]\n";
+    std::cerr << "TOTAL [ SAMPLES : TIME (s) : THROUGHPUT (samples/s) ] -> [ " << readCount << " : " << elapsed.count()
+              << " : " << (elapsed.count() > 0.0 ? readCount / elapsed.count() : 0.0) << " ]\n";
+    return 0;
+}